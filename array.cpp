@@ -1,108 +1,1733 @@
-#include <lua.hpp>
+#include "array.h"
 #include <assert.h>
 #include <string.h>
 #include <math.h>
-#include <vector>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
 #include <string>
+#include <chrono>
+#include <new>
+#include <type_traits>
 
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
 
+#ifdef _WIN32
+#define fseek64 _fseeki64
+#define ftell64 _ftelli64
+#else
+#define fseek64 fseeko
+#define ftell64 ftello
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ARRAY_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+void benchmarkArrayAllocation(size_t count);
+void benchmarkArrayAccess();
+
+// make-bench.bat links this file with ARRAY_NO_MAIN into bench.cpp, which brings its own main
+#ifndef ARRAY_NO_MAIN
 int main()
 {
 	lua_State* lua;
 	lua = luaL_newstate();
 	luaL_openlibs(lua);
 
-	luaL_dofile(lua, "using_array.lua");
+	openArray(lua);
+	if (luaL_dofile(lua, "using-array.lua")) {
+		puts(lua_tostring(lua, -1));
+	}
 
 	lua_close(lua);
+
+	// benchmarkArrayAllocation(10000000);
+	// benchmarkArrayAccess();
+}
+#endif
+
+/************* Bulk kernels **************/
+
+// Kernels over the elements of number arrays. Each one has a scalar, an SSE2 and an AVX2
+// variant; the best variant the CPU supports is picked once, when the program starts.
+typedef struct {
+	double (*sum)(const double* x, size_t n);
+	double (*dot)(const double* x, const double* y, size_t n);
+	void (*scale)(double* x, size_t n, double k);
+	void (*axpy)(double* y, double a, const double* x, size_t n);
+	void (*minmax)(const double* x, size_t n, double* min, double* max);
+} NumberKernels;
+
+double sumScalar(const double* x, size_t n)
+{
+	double s = 0;
+	for (size_t i = 0; i < n; i++) s += x[i];
+	return s;
+}
+
+double dotScalar(const double* x, const double* y, size_t n)
+{
+	double s = 0;
+	for (size_t i = 0; i < n; i++) s += x[i] * y[i];
+	return s;
+}
+
+void scaleScalar(double* x, size_t n, double k)
+{
+	for (size_t i = 0; i < n; i++) x[i] *= k;
+}
+
+void axpyScalar(double* y, double a, const double* x, size_t n)
+{
+	for (size_t i = 0; i < n; i++) y[i] += a * x[i];
+}
+
+// n must not be zero
+void minmaxScalar(const double* x, size_t n, double* min, double* max)
+{
+	double lo = x[0], hi = x[0];
+	for (size_t i = 1; i < n; i++) {
+		if (x[i] < lo) lo = x[i];
+		if (x[i] > hi) hi = x[i];
+	}
+	*min = lo;
+	*max = hi;
+}
+
+#ifdef ARRAY_X86_KERNELS
+
+__attribute__((target("sse2")))
+double sumSSE2(const double* x, size_t n)
+{
+	__m128d a0 = _mm_setzero_pd(), a1 = _mm_setzero_pd();
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		a0 = _mm_add_pd(a0, _mm_loadu_pd(x + i));
+		a1 = _mm_add_pd(a1, _mm_loadu_pd(x + i + 2));
+	}
+	double lanes[2];
+	_mm_storeu_pd(lanes, _mm_add_pd(a0, a1));
+	return lanes[0] + lanes[1] + sumScalar(x + i, n - i);
+}
+
+__attribute__((target("sse2")))
+double dotSSE2(const double* x, const double* y, size_t n)
+{
+	__m128d a0 = _mm_setzero_pd(), a1 = _mm_setzero_pd();
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		a0 = _mm_add_pd(a0, _mm_mul_pd(_mm_loadu_pd(x + i), _mm_loadu_pd(y + i)));
+		a1 = _mm_add_pd(a1, _mm_mul_pd(_mm_loadu_pd(x + i + 2), _mm_loadu_pd(y + i + 2)));
+	}
+	double lanes[2];
+	_mm_storeu_pd(lanes, _mm_add_pd(a0, a1));
+	return lanes[0] + lanes[1] + dotScalar(x + i, y + i, n - i);
+}
+
+__attribute__((target("sse2")))
+void scaleSSE2(double* x, size_t n, double k)
+{
+	__m128d vk = _mm_set1_pd(k);
+	size_t i = 0;
+	for (; i + 2 <= n; i += 2)
+		_mm_storeu_pd(x + i, _mm_mul_pd(_mm_loadu_pd(x + i), vk));
+	scaleScalar(x + i, n - i, k);
+}
+
+__attribute__((target("sse2")))
+void axpySSE2(double* y, double a, const double* x, size_t n)
+{
+	__m128d va = _mm_set1_pd(a);
+	size_t i = 0;
+	for (; i + 2 <= n; i += 2)
+		_mm_storeu_pd(y + i, _mm_add_pd(_mm_loadu_pd(y + i), _mm_mul_pd(va, _mm_loadu_pd(x + i))));
+	axpyScalar(y + i, a, x + i, n - i);
+}
+
+__attribute__((target("sse2")))
+void minmaxSSE2(const double* x, size_t n, double* min, double* max)
+{
+	if (n < 2) {
+		minmaxScalar(x, n, min, max);
+		return;
+	}
+	__m128d lo = _mm_loadu_pd(x), hi = lo;
+	size_t i = 2;
+	for (; i + 2 <= n; i += 2) {
+		__m128d v = _mm_loadu_pd(x + i);
+		lo = _mm_min_pd(lo, v);
+		hi = _mm_max_pd(hi, v);
+	}
+	double l[2], h[2];
+	_mm_storeu_pd(l, lo);
+	_mm_storeu_pd(h, hi);
+	*min = l[0] < l[1] ? l[0] : l[1];
+	*max = h[0] > h[1] ? h[0] : h[1];
+	for (; i < n; i++) {
+		if (x[i] < *min) *min = x[i];
+		if (x[i] > *max) *max = x[i];
+	}
+}
+
+__attribute__((target("avx2")))
+double sumAVX2(const double* x, size_t n)
+{
+	__m256d a0 = _mm256_setzero_pd(), a1 = _mm256_setzero_pd();
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		a0 = _mm256_add_pd(a0, _mm256_loadu_pd(x + i));
+		a1 = _mm256_add_pd(a1, _mm256_loadu_pd(x + i + 4));
+	}
+	double lanes[4];
+	_mm256_storeu_pd(lanes, _mm256_add_pd(a0, a1));
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] + sumScalar(x + i, n - i);
+}
+
+__attribute__((target("avx2")))
+double dotAVX2(const double* x, const double* y, size_t n)
+{
+	__m256d a0 = _mm256_setzero_pd(), a1 = _mm256_setzero_pd();
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		a0 = _mm256_add_pd(a0, _mm256_mul_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+		a1 = _mm256_add_pd(a1, _mm256_mul_pd(_mm256_loadu_pd(x + i + 4), _mm256_loadu_pd(y + i + 4)));
+	}
+	double lanes[4];
+	_mm256_storeu_pd(lanes, _mm256_add_pd(a0, a1));
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] + dotScalar(x + i, y + i, n - i);
+}
+
+__attribute__((target("avx2")))
+void scaleAVX2(double* x, size_t n, double k)
+{
+	__m256d vk = _mm256_set1_pd(k);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4)
+		_mm256_storeu_pd(x + i, _mm256_mul_pd(_mm256_loadu_pd(x + i), vk));
+	scaleScalar(x + i, n - i, k);
+}
+
+__attribute__((target("avx2")))
+void axpyAVX2(double* y, double a, const double* x, size_t n)
+{
+	__m256d va = _mm256_set1_pd(a);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4)
+		_mm256_storeu_pd(y + i, _mm256_add_pd(_mm256_loadu_pd(y + i), _mm256_mul_pd(va, _mm256_loadu_pd(x + i))));
+	axpyScalar(y + i, a, x + i, n - i);
+}
+
+__attribute__((target("avx2")))
+void minmaxAVX2(const double* x, size_t n, double* min, double* max)
+{
+	if (n < 4) {
+		minmaxScalar(x, n, min, max);
+		return;
+	}
+	__m256d lo = _mm256_loadu_pd(x), hi = lo;
+	size_t i = 4;
+	for (; i + 4 <= n; i += 4) {
+		__m256d v = _mm256_loadu_pd(x + i);
+		lo = _mm256_min_pd(lo, v);
+		hi = _mm256_max_pd(hi, v);
+	}
+	double l[4], h[4];
+	_mm256_storeu_pd(l, lo);
+	_mm256_storeu_pd(h, hi);
+	minmaxScalar(l, 4, min, max);
+	*max = h[0];
+	for (int j = 1; j < 4; j++)
+		if (h[j] > *max) *max = h[j];
+	for (; i < n; i++) {
+		if (x[i] < *min) *min = x[i];
+		if (x[i] > *max) *max = x[i];
+	}
+}
+
+#endif
+
+NumberKernels selectNumberKernels()
+{
+	NumberKernels kernels = {sumScalar, dotScalar, scaleScalar, axpyScalar, minmaxScalar};
+#ifdef ARRAY_X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		NumberKernels avx2 = {sumAVX2, dotAVX2, scaleAVX2, axpyAVX2, minmaxAVX2};
+		kernels = avx2;
+	}
+	else if (__builtin_cpu_supports("sse2")) {
+		NumberKernels sse2 = {sumSSE2, dotSSE2, scaleSSE2, axpySSE2, minmaxSSE2};
+		kernels = sse2;
+	}
+#endif
+	return kernels;
+}
+
+const NumberKernels Kernels = selectNumberKernels();
+
+// sums of integer arrays are integers, everything else accumulates in doubles
+template <typename T> struct Accumulator { typedef lua_Integer type; };
+template <> struct Accumulator<double> { typedef double type; };
+template <> struct Accumulator<float> { typedef double type; };
+
+// integer arithmetic runs on the unsigned type of the same width, so it wraps around the
+// way Lua integers do instead of overflowing
+template <typename T, bool = std::is_integral<T>::value> struct Wrapping { typedef T type; };
+template <typename T> struct Wrapping<T, true> { typedef typename std::make_unsigned<T>::type type; };
+
+template <typename T>
+typename Accumulator<T>::type sumElements(const T* x, size_t n)
+{
+	typedef typename Wrapping<typename Accumulator<T>::type>::type Sum;
+	Sum s = 0;
+	for (size_t i = 0; i < n; i++) s += (Sum)x[i];
+	return (typename Accumulator<T>::type)s;
+}
+
+template <typename T>
+typename Accumulator<T>::type dotElements(const T* x, const T* y, size_t n)
+{
+	typedef typename Wrapping<typename Accumulator<T>::type>::type Sum;
+	Sum s = 0;
+	for (size_t i = 0; i < n; i++) s += (Sum)x[i] * (Sum)y[i];
+	return (typename Accumulator<T>::type)s;
+}
+
+template <typename T>
+void scaleElements(T* x, size_t n, T k)
+{
+	typedef typename Wrapping<T>::type W;
+	for (size_t i = 0; i < n; i++) x[i] = (T)((W)x[i] * (W)k);
 }
 
+template <typename T>
+void axpyElements(T* y, T a, const T* x, size_t n)
+{
+	typedef typename Wrapping<T>::type W;
+	for (size_t i = 0; i < n; i++) y[i] = (T)((W)y[i] + (W)a * (W)x[i]);
+}
+
+template <typename T>
+void minmaxElements(const T* x, size_t n, T* min, T* max)
+{
+	T lo = x[0], hi = x[0];
+	for (size_t i = 1; i < n; i++) {
+		if (x[i] < lo) lo = x[i];
+		if (x[i] > hi) hi = x[i];
+	}
+	*min = lo;
+	*max = hi;
+}
+
+template <> double sumElements<double>(const double* x, size_t n) { return Kernels.sum(x, n); }
+template <> double dotElements<double>(const double* x, const double* y, size_t n) { return Kernels.dot(x, y, n); }
+template <> void scaleElements<double>(double* x, size_t n, double k) { Kernels.scale(x, n, k); }
+template <> void axpyElements<double>(double* y, double a, const double* x, size_t n) { Kernels.axpy(y, a, x, n); }
+template <> void minmaxElements<double>(const double* x, size_t n, double* min, double* max) { Kernels.minmax(x, n, min, max); }
+
 /************* Using userdata **************/
 
 #define setfunction(f, n) (lua_pushcfunction(lua, f), lua_setfield(lua, -2, n))
 
+// registry keys of the set of array metatables and of the metatable of each element type
+static char ArrayKey;
+static char ArrayTypeKeys[ARRAY_TYPES];
+static char ArrayViewTypeKeys[ARRAY_TYPES];
+
+const char* const ArrayTypeNames[] = {"number", "float32", "int32", "int64", "uint8", "string", NULL};
+
+const size_t ArrayElementSizes[] = {
+	sizeof(double), sizeof(float), sizeof(int32_t), sizeof(int64_t), sizeof(uint8_t), sizeof(ArrayString)
+};
+
+int isArrayMetatable(lua_State* lua, int index, int metatable)
+{
+	if (lua_type(lua, index) != LUA_TUSERDATA || !lua_getmetatable(lua, index))
+		return 0;
+	int same = lua_rawequal(lua, -1, metatable);
+	lua_pop(lua, 1);
+	return same;
+}
+
+Array* toArray(lua_State* lua, int index)
+{
+	if (lua_type(lua, index) != LUA_TUSERDATA || !lua_getmetatable(lua, index))
+		return NULL;
+	lua_rawgetp(lua, LUA_REGISTRYINDEX, &ArrayKey);
+	lua_insert(lua, -2);
+	int found = lua_rawget(lua, -2) != LUA_TNIL;
+	lua_pop(lua, 2);
+	return found ? (Array*)lua_touserdata(lua, index) : NULL;
+}
+
+Array* checkArray(lua_State* lua, int index)
+{
+	Array* arr = toArray(lua, index);
+	luaL_argcheck(lua, arr != NULL, index, "expected an array");
+	return arr;
+}
+
+// Every array function is a closure whose first upvalue is the metatable of its element type,
+// so the type check in the hot metamethods is a pointer comparison with no registry lookup.
+Array* checkArrayArg(lua_State* lua, int arg)
+{
+	luaL_argcheck(lua, isArrayMetatable(lua, arg, lua_upvalueindex(1)), arg, "expected an array");
+	return (Array*)lua_touserdata(lua, arg);
+}
+
+void checkWritable(lua_State* lua, Array* arr)
+{
+	if (arr->readonly || (arr->storage == ARRAY_SHARED && arr->shared->frozen.load(std::memory_order_acquire)))
+		luaL_error(lua, "array is read-only");
+}
+
+void checkResizable(lua_State* lua, Array* arr)
+{
+	if (arr->storage == ARRAY_MAPPED)
+		luaL_error(lua, "mapped arrays cannot be resized");
+	if (arr->storage == ARRAY_SHARED)
+		luaL_error(lua, "shared arrays cannot be resized");
+}
+
+// Buffers of at least this many bytes are aligned to (and advised as) huge pages, which
+// keeps TLB misses down when kernels stream over arrays of hundreds of millions of elements.
+// Whether a buffer is huge depends only on its byte size, so allocation and release agree.
+#define ARRAY_HUGE_PAGE ((size_t)2 * 1024 * 1024)
+
+void* allocateBuffer(size_t bytes)
+{
+	if (bytes < ARRAY_HUGE_PAGE)
+		return malloc(bytes);
+#ifdef _WIN32
+	// 64 KB aligned; real large pages need the SeLockMemoryPrivilege
+	return VirtualAlloc(NULL, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+	void* data;
+	if (posix_memalign(&data, ARRAY_HUGE_PAGE, bytes) != 0)
+		return NULL;
+#ifdef MADV_HUGEPAGE
+	madvise(data, bytes - bytes % ARRAY_HUGE_PAGE, MADV_HUGEPAGE);
+#endif
+	return data;
+#endif
+}
+
+void freeBuffer(void* data, size_t bytes)
+{
+	if (bytes < ARRAY_HUGE_PAGE) {
+		free(data);
+		return;
+	}
+#ifdef _WIN32
+	VirtualFree(data, 0, MEM_RELEASE);
+#else
+	free(data);
+#endif
+}
+
+// keeps the first used bytes; returns NULL and leaves data untouched on failure
+void* resizeBuffer(void* data, size_t bytes, size_t newBytes, size_t used)
+{
+	if (newBytes < ARRAY_HUGE_PAGE)
+		return realloc(data, newBytes);
+	void* resized = allocateBuffer(newBytes);
+	if (resized == NULL)
+		return NULL;
+	if (used > 0)
+		memcpy(resized, data, used);
+	freeBuffer(data, bytes);
+	return resized;
+}
+
+// grows the buffer geometrically so that a sequence of appends is amortized O(1)
+void reserveArray(lua_State* lua, Array* arr, size_t capacity)
+{
+	if (capacity <= arr->capacity)
+		return;
+	checkResizable(lua, arr);
+	size_t elementSize = ArrayElementSizes[arr->type];
+	size_t limit = SIZE_MAX / elementSize;
+	if (capacity > limit)
+		luaL_error(lua, "array too large");
+	size_t grown = arr->capacity < 4 ? 4 : arr->capacity <= limit / 2 ? arr->capacity * 2 : limit;
+	if (grown < capacity) grown = capacity;
+	void* data = resizeBuffer(arr->data, arr->capacity * elementSize, grown * elementSize, arr->size * elementSize);
+	if (data == NULL)
+		luaL_error(lua, "not enough memory");
+	arr->data = data;
+	arr->capacity = grown;
+}
+
+// rewrites the arena keeping only the bytes the elements still refer to
+void compactStrings(lua_State* lua, Array* arr, size_t capacity)
+{
+	StringArena* arena = &arr->strings;
+	char* bytes = (char*)malloc(capacity);
+	if (bytes == NULL)
+		luaL_error(lua, "not enough memory");
+	size_t size = 0;
+	ArrayString* strings = elements<ArrayString>(arr);
+	for (size_t i = 0; i < arr->size; i++) {
+		memcpy(bytes + size, arena->bytes + strings[i].offset, strings[i].length);
+		strings[i].offset = size;
+		size += strings[i].length;
+	}
+	free(arena->bytes);
+	arena->bytes = bytes;
+	arena->size = size;
+	arena->capacity = capacity;
+	arena->garbage = 0;
+}
+
+// copies a string to the end of the arena and returns its offset
+size_t internString(lua_State* lua, Array* arr, const char* s, size_t length)
+{
+	StringArena* arena = &arr->strings;
+	if (length > arena->capacity - arena->size) {
+		// at least half of the new arena is left free, so compactions stay amortized O(1)
+		size_t live = arena->size - arena->garbage;
+		if (length > SIZE_MAX / 4 - live)
+			luaL_error(lua, "string array too large");
+		size_t capacity = arena->capacity < 64 ? 64 : arena->capacity;
+		while (capacity < 2 * (live + length)) capacity *= 2;
+		compactStrings(lua, arr, capacity);
+	}
+	memcpy(arena->bytes + arena->size, s, length);
+	size_t offset = arena->size;
+	arena->size += length;
+	return offset;
+}
+
+/* Element access, specialized per element type so that each accessor is monomorphic */
+
+inline void pushElement(lua_State* lua, double v) { lua_pushnumber(lua, v); }
+inline void pushElement(lua_State* lua, float v) { lua_pushnumber(lua, v); }
+inline void pushElement(lua_State* lua, int32_t v) { lua_pushinteger(lua, v); }
+inline void pushElement(lua_State* lua, int64_t v) { lua_pushinteger(lua, v); }
+inline void pushElement(lua_State* lua, uint8_t v) { lua_pushinteger(lua, v); }
+
+template <typename T> T checkElement(lua_State* lua, int arg);
+
+template <> double checkElement<double>(lua_State* lua, int arg)
+{
+	return luaL_checknumber(lua, arg);
+}
+
+template <> float checkElement<float>(lua_State* lua, int arg)
+{
+	return (float)luaL_checknumber(lua, arg);
+}
+
+template <> int32_t checkElement<int32_t>(lua_State* lua, int arg)
+{
+	lua_Integer v = luaL_checkinteger(lua, arg);
+	luaL_argcheck(lua, INT32_MIN <= v && v <= INT32_MAX, arg, "value out of int32 range");
+	return (int32_t)v;
+}
+
+template <> int64_t checkElement<int64_t>(lua_State* lua, int arg)
+{
+	return luaL_checkinteger(lua, arg);
+}
+
+template <> uint8_t checkElement<uint8_t>(lua_State* lua, int arg)
+{
+	lua_Integer v = luaL_checkinteger(lua, arg);
+	luaL_argcheck(lua, 0 <= v && v <= UINT8_MAX, arg, "value out of uint8 range");
+	return (uint8_t)v;
+}
+
+// elementError is the non-raising form of checkElement for values that are not arguments:
+// the reason the value at index cannot be stored as a T, or NULL if it can
+template <typename T> const char* elementError(lua_State* lua, int index);
+
+inline const char* numberError(lua_State* lua, int index)
+{
+	int isnum;
+	lua_tonumberx(lua, index, &isnum);
+	return isnum ? NULL : lua_pushfstring(lua, "number expected, got %s", luaL_typename(lua, index));
+}
+
+template <> const char* elementError<double>(lua_State* lua, int index) { return numberError(lua, index); }
+template <> const char* elementError<float>(lua_State* lua, int index) { return numberError(lua, index); }
+
+// the integer at index must lie in [min, max]
+inline const char* integerError(lua_State* lua, int index, lua_Integer min, lua_Integer max, const char* type)
+{
+	int isnum;
+	lua_Integer v = lua_tointegerx(lua, index, &isnum);
+	if (!isnum)
+		return lua_isnumber(lua, index) ? "number has no integer representation"
+			: lua_pushfstring(lua, "number expected, got %s", luaL_typename(lua, index));
+	return min <= v && v <= max ? NULL : lua_pushfstring(lua, "value out of %s range", type);
+}
+
+template <> const char* elementError<int32_t>(lua_State* lua, int index) { return integerError(lua, index, INT32_MIN, INT32_MAX, "int32"); }
+template <> const char* elementError<int64_t>(lua_State* lua, int index) { return integerError(lua, index, LUA_MININTEGER, LUA_MAXINTEGER, "int64"); }
+template <> const char* elementError<uint8_t>(lua_State* lua, int index) { return integerError(lua, index, 0, UINT8_MAX, "uint8"); }
+
+template <> const char* elementError<ArrayString>(lua_State* lua, int index)
+{
+	return lua_isstring(lua, index) ? NULL : lua_pushfstring(lua, "string expected, got %s", luaL_typename(lua, index));
+}
+
+template <typename T> struct ArrayTypeOf;
+template <> struct ArrayTypeOf<double> { static const ArrayType value = ARRAY_NUMBER; };
+template <> struct ArrayTypeOf<float> { static const ArrayType value = ARRAY_FLOAT32; };
+template <> struct ArrayTypeOf<int32_t> { static const ArrayType value = ARRAY_INT32; };
+template <> struct ArrayTypeOf<int64_t> { static const ArrayType value = ARRAY_INT64; };
+template <> struct ArrayTypeOf<uint8_t> { static const ArrayType value = ARRAY_UINT8; };
+template <> struct ArrayTypeOf<ArrayString> { static const ArrayType value = ARRAY_STRING; };
+
+// check validates a Lua value before the array is touched, store writes it into a slot
+template <typename T>
+struct ArrayElement {
+	typedef T Value;
+
+	static Value check(lua_State* lua, int arg) { return checkElement<T>(lua, arg); }
+	static void push(lua_State* lua, Array* arr, size_t i) { pushElement(lua, elements<T>(arr)[i]); }
+	static void store(lua_State* lua, Array* arr, size_t i, Value v) { elements<T>(arr)[i] = v; }
+	static void release(Array* arr, size_t i) {}
+};
+
 typedef struct {
-	unsigned int size;
-	double data[0];
-} Array;
+	const char* bytes;
+	size_t length;
+} StringValue;
+
+// string elements live in the array's arena rather than as references to Lua strings
+template <>
+struct ArrayElement<ArrayString> {
+	typedef StringValue Value;
+
+	static Value check(lua_State* lua, int arg)
+	{
+		Value v;
+		v.bytes = luaL_checklstring(lua, arg, &v.length);
+		return v;
+	}
+
+	static void push(lua_State* lua, Array* arr, size_t i)
+	{
+		ArrayString s = elements<ArrayString>(arr)[i];
+		lua_pushlstring(lua, arr->strings.bytes + s.offset, s.length);
+	}
+
+	static void store(lua_State* lua, Array* arr, size_t i, Value v)
+	{
+		release(arr, i);
+		elements<ArrayString>(arr)[i].length = 0;
+		size_t offset = internString(lua, arr, v.bytes, v.length);
+		elements<ArrayString>(arr)[i].offset = offset;
+		elements<ArrayString>(arr)[i].length = v.length;
+	}
+
+	static void release(Array* arr, size_t i)
+	{
+		arr->strings.garbage += elements<ArrayString>(arr)[i].length;
+	}
+};
 
-// __index
+// __index: integer keys read the elements, string keys find the methods table (upvalue 2)
+template <typename T>
 int array_get(lua_State* lua)
 {
-	Array* arr = (Array*)lua_touserdata(lua, 1);
-	int i = luaL_checkinteger(lua, 2);
-	luaL_argcheck(lua, arr != NULL, 2, "expected an array");
-	luaL_argcheck(lua, 0 < i && i <= arr->size, 2, "index out of range");
-	lua_pushnumber(lua, arr->data[i-1]);
+	Array* arr = checkArrayArg(lua, 1);
+	if (lua_type(lua, 2) == LUA_TSTRING) {
+		lua_pushvalue(lua, 2);
+		lua_rawget(lua, lua_upvalueindex(2));
+		return 1;
+	}
+	lua_Integer i = luaL_checkinteger(lua, 2);
+	luaL_argcheck(lua, 0 < i && (size_t)i <= arr->size, 2, "index out of range");
+	ArrayElement<T>::push(lua, arr, i-1);
 	return 1;
 }
 
 // __newindex
+template <typename T>
 int array_set(lua_State* lua)
 {
-	Array* arr = (Array*)lua_touserdata(lua, 1);
-	int i = luaL_checkinteger(lua, 2);
-	double v = luaL_checknumber(lua, 3);	
-	luaL_argcheck(lua, arr != NULL, 2, "expected an array");
-	luaL_argcheck(lua, 0 < i && i <= arr->size, 2, "index out of range");
-	arr->data[i-1] = v;
+	Array* arr = checkArrayArg(lua, 1);
+	lua_Integer i = luaL_checkinteger(lua, 2);
+	typename ArrayElement<T>::Value v = ArrayElement<T>::check(lua, 3);
+	luaL_argcheck(lua, 0 < i && (size_t)i <= arr->size, 2, "index out of range");
+	checkWritable(lua, arr);
+	ArrayElement<T>::store(lua, arr, i-1, v);
 	return 0;
 }
 
-// __len
-int array_size(lua_State* lua)
+void unmapFile(void* data, size_t length);
+
+// __gc
+int array_free(lua_State* lua)
 {
-	luaL_checktype(lua, 1, LUA_TUSERDATA);
-	Array* arr = (Array*)lua_touserdata(lua, 1);
-	lua_pushinteger(lua, arr->size);
-	return 1;
+	Array* arr = checkArrayArg(lua, 1);
+	if (arr->storage == ARRAY_SHARED)
+		releaseSharedBuffer(arr->shared);
+	else if (arr->storage == ARRAY_MAPPED)
+		unmapFile(arr->data, (size_t)arr->capacity * ArrayElementSizes[arr->type]);
+	else
+		freeBuffer(arr->data, arr->capacity * ArrayElementSizes[arr->type]);
+	free(arr->strings.bytes);
+	// __gc can be called by hand: leave an empty heap array that is safe to use or free again
+	arr->storage = ARRAY_HEAP;
+	arr->readonly = 0;
+	arr->shared = NULL;
+	arr->data = NULL;
+	arr->size = arr->capacity = 0;
+	memset(&arr->strings, 0, sizeof(StringArena));
+	return 0;
 }
 
-Array* createArray(lua_State* lua, size_t size)
+Array* createArray(lua_State* lua, size_t size, ArrayType type)
 {
-	Array* arr = (Array*)lua_newuserdata(lua, sizeof(Array) + size * sizeof(double));
-	arr->size = size;
-		lua_newtable(lua); // array metatable
-		setfunction(array_get, "__index");
-		setfunction(array_set, "__newindex");
-		setfunction(array_size, "__len");
+	Array* arr = (Array*)lua_newuserdata(lua, sizeof(Array));
+	memset(arr, 0, sizeof(Array));
+	arr->type = type;
+	lua_rawgetp(lua, LUA_REGISTRYINDEX, &ArrayTypeKeys[type]);
 	lua_setmetatable(lua, -2);
+	reserveArray(lua, arr, size);
+	if (size > 0)
+		memset(arr->data, 0, size * ArrayElementSizes[type]);
+	arr->size = size;
 	return arr;
 }
 
+/* Array operations; each is instantiated once per element type */
+
+// arr:size()
+struct ArraySize {
+	template <typename T>
+	static int call(lua_State* lua, Array* arr)
+	{
+		lua_pushinteger(lua, arr->size);
+		return 1;
+	}
+};
+
+// arr:add(value)
+struct ArrayAdd {
+	template <typename T>
+	static int call(lua_State* lua, Array* arr)
+	{
+		typename ArrayElement<T>::Value v = ArrayElement<T>::check(lua, 2);
+		checkWritable(lua, arr);
+		checkResizable(lua, arr);
+		reserveArray(lua, arr, (size_t)arr->size + 1);
+		elements<T>(arr)[arr->size] = T();
+		ArrayElement<T>::store(lua, arr, arr->size, v);
+		arr->size++;
+		return 0;
+	}
+};
+
+// arr:insert(value [, position])
+struct ArrayInsert {
+	template <typename T>
+	static int call(lua_State* lua, Array* arr)
+	{
+		typename ArrayElement<T>::Value v = ArrayElement<T>::check(lua, 2);
+		lua_Integer i = luaL_optinteger(lua, 3, (lua_Integer)arr->size + 1);
+		luaL_argcheck(lua, 0 < i && i <= (lua_Integer)arr->size + 1, 3, "position out of range");
+		checkWritable(lua, arr);
+		checkResizable(lua, arr);
+		reserveArray(lua, arr, (size_t)arr->size + 1);
+		T* data = elements<T>(arr);
+		memmove(data + i, data + i - 1, (arr->size - (i - 1)) * sizeof(T));
+		data[i-1] = T();
+		arr->size++;
+		ArrayElement<T>::store(lua, arr, i-1, v);
+		return 0;
+	}
+};
+
+// arr:remove([position]) returns the removed value
+struct ArrayRemove {
+	template <typename T>
+	static int call(lua_State* lua, Array* arr)
+	{
+		lua_Integer i = luaL_optinteger(lua, 2, arr->size);
+		luaL_argcheck(lua, 0 < i && i <= (lua_Integer)arr->size, 2, "position out of range");
+		checkWritable(lua, arr);
+		checkResizable(lua, arr);
+		ArrayElement<T>::push(lua, arr, i-1);
+		ArrayElement<T>::release(arr, i-1);
+		T* data = elements<T>(arr);
+		memmove(data + i - 1, data + i, (arr->size - i) * sizeof(T));
+		arr->size--;
+		return 1;
+	}
+};
+
+// arr:assign(value, index)
+struct ArrayAssign {
+	template <typename T>
+	static int call(lua_State* lua, Array* arr)
+	{
+		typename ArrayElement<T>::Value v = ArrayElement<T>::check(lua, 2);
+		lua_Integer i = luaL_checkinteger(lua, 3);
+		luaL_argcheck(lua, 0 < i && i <= (lua_Integer)arr->size, 3, "index out of range");
+		checkWritable(lua, arr);
+		ArrayElement<T>::store(lua, arr, i-1, v);
+		return 0;
+	}
+};
+
+/* Higher-order functions; the callback stays at argument 2 and is called with lua_call */
+
+// arr:foreach(function(value, index) end)
+struct ArrayForeach {
+	template <typename T>
+	static int call(lua_State* lua, Array* arr)
+	{
+		luaL_checktype(lua, 2, LUA_TFUNCTION);
+		lua_settop(lua, 2);
+		// the callback may resize the array, so size and data are read again every step
+		for (size_t i = 0; i < arr->size; i++) {
+			lua_pushvalue(lua, 2);
+			ArrayElement<T>::push(lua, arr, i);
+			lua_pushinteger(lua, i + 1);
+			lua_call(lua, 2, 0);
+		}
+		return 0;
+	}
+};
+
+// arr:map(function(value, index) return v end) returns a new array of the same type
+struct ArrayMap {
+	template <typename T>
+	static int call(lua_State* lua, Array* arr)
+	{
+		luaL_checktype(lua, 2, LUA_TFUNCTION);
+		lua_settop(lua, 2);
+		Array* out = createArray(lua, arr->size, arr->type);
+		for (size_t i = 0; i < arr->size && i < out->size; i++) {
+			lua_pushvalue(lua, 2);
+			ArrayElement<T>::push(lua, arr, i);
+			lua_pushinteger(lua, i + 1);
+			lua_call(lua, 2, 1);
+			ArrayElement<T>::store(lua, out, i, ArrayElement<T>::check(lua, 4));
+			lua_pop(lua, 1);
+		}
+		return 1;
+	}
+};
+
+// arr:filter(function(value, index) return keep end) returns a new array of the same type
+struct ArrayFilter {
+	template <typename T>
+	static int call(lua_State* lua, Array* arr)
+	{
+		luaL_checktype(lua, 2, LUA_TFUNCTION);
+		lua_settop(lua, 2);
+		Array* out = createArray(lua, 0, arr->type);
+		reserveArray(lua, out, arr->size);
+		// the element is pushed once, at 4, and a kept element is stored from there: the
+		// callback may resize or write the array before it returns
+		for (size_t i = 0; i < arr->size; i++) {
+			ArrayElement<T>::push(lua, arr, i);
+			lua_pushvalue(lua, 2);
+			lua_pushvalue(lua, 4);
+			lua_pushinteger(lua, i + 1);
+			lua_call(lua, 2, 1);
+			int keep = lua_toboolean(lua, -1);
+			lua_pop(lua, 1);
+			if (keep) {
+				reserveArray(lua, out, (size_t)out->size + 1);
+				elements<T>(out)[out->size] = T();
+				ArrayElement<T>::store(lua, out, out->size, ArrayElement<T>::check(lua, 4));
+				out->size++;
+			}
+			lua_pop(lua, 1);
+		}
+		return 1;
+	}
+};
+
+// arr:reduce(function(acc, value, index) return acc end [, initial])
+// without an initial value the first element starts the accumulator
+struct ArrayReduce {
+	template <typename T>
+	static int call(lua_State* lua, Array* arr)
+	{
+		luaL_checktype(lua, 2, LUA_TFUNCTION);
+		size_t i = 0;
+		if (lua_isnone(lua, 3)) {
+			if (arr->size == 0)
+				return 0;
+			ArrayElement<T>::push(lua, arr, i++);
+		}
+		lua_settop(lua, 3); // the accumulator lives at 3
+		for (; i < arr->size; i++) {
+			lua_pushvalue(lua, 2);
+			lua_pushvalue(lua, 3);
+			ArrayElement<T>::push(lua, arr, i);
+			lua_pushinteger(lua, i + 1);
+			lua_call(lua, 3, 1);
+			lua_replace(lua, 3);
+		}
+		return 1;
+	}
+};
+
+inline void pushAccumulator(lua_State* lua, double v) { lua_pushnumber(lua, v); }
+inline void pushAccumulator(lua_State* lua, lua_Integer v) { lua_pushinteger(lua, v); }
+
+/* Bulk operations of numeric arrays; the number array ones run the SIMD kernels */
+
+// arr:sum()
+struct ArraySum {
+	template <typename T>
+	static int call(lua_State* lua, Array* arr)
+	{
+		pushAccumulator(lua, sumElements(elements<T>(arr), arr->size));
+		return 1;
+	}
+};
+
+// arr:dot(other) where other has the same type and size
+struct ArrayDot {
+	template <typename T>
+	static int call(lua_State* lua, Array* arr)
+	{
+		Array* other = checkArrayArg(lua, 2);
+		luaL_argcheck(lua, other->size == arr->size, 2, "arrays must have the same size");
+		pushAccumulator(lua, dotElements(elements<T>(arr), elements<T>(other), arr->size));
+		return 1;
+	}
+};
+
+// arr:scale(k) multiplies every element by k
+struct ArrayScale {
+	template <typename T>
+	static int call(lua_State* lua, Array* arr)
+	{
+		T k = checkElement<T>(lua, 2);
+		checkWritable(lua, arr);
+		scaleElements(elements<T>(arr), arr->size, k);
+		return 0;
+	}
+};
+
+// arr:axpy(a, x) adds a * x to the elements, x having the same type and size
+struct ArrayAxpy {
+	template <typename T>
+	static int call(lua_State* lua, Array* arr)
+	{
+		T a = checkElement<T>(lua, 2);
+		Array* x = checkArrayArg(lua, 3);
+		luaL_argcheck(lua, x->size == arr->size, 3, "arrays must have the same size");
+		checkWritable(lua, arr);
+		axpyElements(elements<T>(arr), a, elements<T>(x), arr->size);
+		return 0;
+	}
+};
+
+// arr:minmax() returns nothing for an empty array
+struct ArrayMinMax {
+	template <typename T>
+	static int call(lua_State* lua, Array* arr)
+	{
+		if (arr->size == 0)
+			return 0;
+		T min, max;
+		minmaxElements(elements<T>(arr), arr->size, &min, &max);
+		pushElement(lua, min);
+		pushElement(lua, max);
+		return 2;
+	}
+};
+
+// arr:min() and arr:max() keep one of the values of minmax
+template <int which>
+struct ArrayExtreme {
+	template <typename T>
+	static int call(lua_State* lua, Array* arr)
+	{
+		if (ArrayMinMax::call<T>(lua, arr) == 0)
+			return 0;
+		if (which == 0) lua_pop(lua, 1);
+		return 1;
+	}
+};
+
+// method bound to one element type: arr:add(v)
+template <typename T, typename Op>
+int array_method(lua_State* lua)
+{
+	return Op::template call<T>(lua, checkArrayArg(lua, 1));
+}
+
+// function of the array table that works on any element type: array.add(arr, v)
+template <typename Op>
+int array_function(lua_State* lua)
+{
+	Array* arr = checkArray(lua, 1);
+	switch (arr->type) {
+	case ARRAY_NUMBER: return Op::template call<double>(lua, arr);
+	case ARRAY_FLOAT32: return Op::template call<float>(lua, arr);
+	case ARRAY_INT32: return Op::template call<int32_t>(lua, arr);
+	case ARRAY_INT64: return Op::template call<int64_t>(lua, arr);
+	case ARRAY_UINT8: return Op::template call<uint8_t>(lua, arr);
+	default: return Op::template call<ArrayString>(lua, arr);
+	}
+}
+
+// array.new(size [, type])
 int array_new(lua_State* lua)
 {
-	int size = luaL_checkinteger(lua, 1);
- 	createArray(lua, size);
+	lua_Integer size = luaL_checkinteger(lua, 1);
+	int type = luaL_checkoption(lua, 2, "number", ArrayTypeNames);
+	luaL_argcheck(lua, 0 <= size, 1, "invalid size");
+	createArray(lua, size, (ArrayType)type);
 	return 1;
 }
 
-int array_make(lua_State* lua)
+// array.number(...), array.int32(...), array.string(...), ...
+template <typename T>
+int array_of(lua_State* lua)
 {
-	int top = lua_gettop(lua)-1;
-	Array* arr = createArray(lua, top);
+	int top = lua_gettop(lua);
+	for (int i = 1; i <= top; i++)
+		ArrayElement<T>::check(lua, i);
+	Array* arr = createArray(lua, top, ArrayTypeOf<T>::value);
 	for (int i = 0; i < top; i++)
+		ArrayElement<T>::store(lua, arr, i, ArrayElement<T>::check(lua, i + 1));
+	return 1;
+}
+
+// array(...)
+int array_make(lua_State* lua)
+{
+	lua_remove(lua, 1);
+	return array_of<double>(lua);
+}
+
+/* Bulk constructors */
+
+// array.fromtable(t [, type]) copies the sequence t with raw accesses
+struct ArrayFromTable {
+	template <typename T>
+	static int call(lua_State* lua)
 	{
-		arr->data[i] = luaL_checknumber(lua, i + 2);
+		size_t size = lua_rawlen(lua, 1);
+		Array* arr = createArray(lua, size, ArrayTypeOf<T>::value);
+		for (size_t i = 0; i < size; i++) {
+			lua_rawgeti(lua, 1, i + 1);
+			const char* error = elementError<T>(lua, -1);
+			if (error != NULL)
+				return luaL_argerror(lua, 1, lua_pushfstring(lua, "element %I: %s", (lua_Integer)(i + 1), error));
+			ArrayElement<T>::store(lua, arr, i, ArrayElement<T>::check(lua, -1));
+			lua_pop(lua, 1);
+		}
+		return 1;
 	}
+};
+
+// runs Op for the element type named at argument arg
+template <typename Op>
+int callForType(lua_State* lua, int arg)
+{
+	switch (luaL_checkoption(lua, arg, "number", ArrayTypeNames)) {
+	case ARRAY_NUMBER: return Op::template call<double>(lua);
+	case ARRAY_FLOAT32: return Op::template call<float>(lua);
+	case ARRAY_INT32: return Op::template call<int32_t>(lua);
+	case ARRAY_INT64: return Op::template call<int64_t>(lua);
+	case ARRAY_UINT8: return Op::template call<uint8_t>(lua);
+	default: return Op::template call<ArrayString>(lua);
+	}
+}
+
+int array_fromtable(lua_State* lua)
+{
+	luaL_checktype(lua, 1, LUA_TTABLE);
+	return callForType<ArrayFromTable>(lua, 2);
+}
+
+// the element type of a binary buffer; string arrays have no binary layout
+ArrayType checkBinaryType(lua_State* lua, int arg)
+{
+	int type = luaL_checkoption(lua, arg, "number", ArrayTypeNames);
+	luaL_argcheck(lua, type != ARRAY_STRING, arg, "string arrays cannot be read from binary data");
+	return (ArrayType)type;
+}
+
+// array.frombytes(s [, type]) copies the bytes of s, in native byte order
+int array_frombytes(lua_State* lua)
+{
+	size_t length;
+	const char* bytes = luaL_checklstring(lua, 1, &length);
+	ArrayType type = checkBinaryType(lua, 2);
+	size_t elementSize = ArrayElementSizes[type];
+	luaL_argcheck(lua, length % elementSize == 0, 1, "length is not a multiple of the element size");
+	Array* arr = createArray(lua, length / elementSize, type);
+	if (length > 0)
+		memcpy(arr->data, bytes, length);
 	return 1;
 }
 
-void usingUserdata(lua_State* lua)
+// array.fromfile(path [, type]) reads a whole file of binary elements straight into the array
+int array_fromfile(lua_State* lua)
 {
-	lua_settop(lua, 0);
+	const char* path = luaL_checkstring(lua, 1);
+	ArrayType type = checkBinaryType(lua, 2);
+	size_t elementSize = ArrayElementSizes[type];
+	// everything that may raise an error happens while no file is open
+	Array* arr = createArray(lua, 0, type);
+
+	FILE* file = fopen(path, "rb");
+	if (file == NULL)
+		return luaL_fileresult(lua, 0, path);
+	long long length = -1;
+	if (fseek64(file, 0, SEEK_END) == 0)
+		length = ftell64(file);
+	if (length < 0 || (unsigned long long)length > SIZE_MAX || fseek64(file, 0, SEEK_SET) != 0) {
+		int result = luaL_fileresult(lua, 0, path);
+		fclose(file);
+		return result;
+	}
+	if ((size_t)length % elementSize != 0) {
+		fclose(file);
+		lua_pushnil(lua);
+		lua_pushfstring(lua, "%s: size is not a valid array of %s", path, ArrayTypeNames[type]);
+		return 2;
+	}
+
+	size_t size = (size_t)length / elementSize;
+	if (size > 0) {
+		arr->data = allocateBuffer(size * elementSize);
+		if (arr->data == NULL) {
+			fclose(file);
+			return luaL_error(lua, "not enough memory");
+		}
+		arr->capacity = size;
+	}
+	size_t read = size > 0 ? fread(arr->data, elementSize, size, file) : 0;
+	fclose(file);
+	if (read != size) {
+		lua_pushnil(lua);
+		lua_pushfstring(lua, "%s: could not read the whole file", path);
+		return 2;
+	}
+	arr->size = size;
+	return 1;
+}
+
+/* Memory-mapped arrays */
+
+enum { ARRAY_MAP_READ, ARRAY_MAP_COPY, ARRAY_MAP_WRITE };
+
+// read-only, copy-on-write and shared-write
+const char* const ArrayMapModes[] = {"r", "c", "w", NULL};
+
+// maps the whole file; an empty file maps to NULL. Returns 0 on failure.
+int mapFile(const char* path, int mode, void** data, size_t* length)
+{
+	*data = NULL;
+	*length = 0;
+#ifdef _WIN32
+	DWORD access = mode == ARRAY_MAP_WRITE ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ;
+	HANDLE file = CreateFileA(path, access, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return 0;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || (unsigned long long)size.QuadPart > SIZE_MAX) {
+		CloseHandle(file);
+		return 0;
+	}
+	*length = (size_t)size.QuadPart;
+	if (*length > 0) {
+		DWORD protect = mode == ARRAY_MAP_READ ? PAGE_READONLY : mode == ARRAY_MAP_COPY ? PAGE_WRITECOPY : PAGE_READWRITE;
+		DWORD view = mode == ARRAY_MAP_READ ? FILE_MAP_READ : mode == ARRAY_MAP_COPY ? FILE_MAP_COPY : FILE_MAP_WRITE;
+		HANDLE mapping = CreateFileMappingA(file, NULL, protect, 0, 0, NULL);
+		if (mapping != NULL) {
+			*data = MapViewOfFile(mapping, view, 0, 0, 0);
+			CloseHandle(mapping); // the view keeps the mapping alive
+		}
+	}
+	CloseHandle(file);
+#else
+	int fd = open(path, mode == ARRAY_MAP_WRITE ? O_RDWR : O_RDONLY);
+	if (fd < 0)
+		return 0;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (unsigned long long)st.st_size > SIZE_MAX) {
+		close(fd);
+		return 0;
+	}
+	*length = (size_t)st.st_size;
+	if (*length > 0) {
+		int protect = mode == ARRAY_MAP_READ ? PROT_READ : PROT_READ | PROT_WRITE;
+		int flags = mode == ARRAY_MAP_COPY ? MAP_PRIVATE : MAP_SHARED;
+		void* pages = mmap(NULL, *length, protect, flags, fd, 0);
+		*data = pages == MAP_FAILED ? NULL : pages;
+	}
+	int error = errno;
+	close(fd); // the mapping keeps the file alive
+	errno = error;
+#endif
+	return *length == 0 || *data != NULL;
+}
+
+void unmapFile(void* data, size_t length)
+{
+	if (data == NULL)
+		return;
+#ifdef _WIN32
+	UnmapViewOfFile(data);
+#else
+	munmap(data, length);
+#endif
+}
+
+// array.mmap(path [, mode [, type]]) maps a file of binary elements without reading it
+int array_mmap(lua_State* lua)
+{
+	const char* path = luaL_checkstring(lua, 1);
+	int mode = luaL_checkoption(lua, 2, "r", ArrayMapModes);
+	ArrayType type = checkBinaryType(lua, 3);
+	size_t elementSize = ArrayElementSizes[type];
+	Array* arr = createArray(lua, 0, type);
+
+	void* data;
+	size_t length;
+	if (!mapFile(path, mode, &data, &length)) {
+#ifdef _WIN32
+		lua_pushnil(lua);
+		lua_pushfstring(lua, "%s: cannot map file (error %d)", path, (int)GetLastError());
+		return 2;
+#else
+		return luaL_fileresult(lua, 0, path);
+#endif
+	}
+	if (length % elementSize != 0) {
+		unmapFile(data, length);
+		lua_pushnil(lua);
+		lua_pushfstring(lua, "%s: size is not a valid array of %s", path, ArrayTypeNames[type]);
+		return 2;
+	}
+
+	arr->storage = ARRAY_MAPPED;
+	arr->readonly = mode == ARRAY_MAP_READ;
+	arr->data = data;
+	arr->size = arr->capacity = length / elementSize;
+	return 1;
+}
+
+/* Shared arrays: elements outside the state, reference counted across states and threads */
+
+SharedBuffer* shareArray(lua_State* lua, Array* arr)
+{
+	if (arr->storage == ARRAY_SHARED) {
+		retainSharedBuffer(arr->shared);
+		return arr->shared;
+	}
+	if (arr->type == ARRAY_STRING)
+		luaL_error(lua, "string arrays cannot be shared");
+	SharedBuffer* buffer = new (std::nothrow) SharedBuffer();
+	if (buffer == NULL)
+		luaL_error(lua, "not enough memory");
+	// the array keeps one reference and the caller gets the other
+	buffer->refs.store(2, std::memory_order_relaxed);
+	buffer->frozen.store(arr->readonly != 0, std::memory_order_relaxed);
+	buffer->type = arr->type;
+	buffer->storage = arr->storage;
+	buffer->size = arr->size;
+	buffer->bytes = arr->capacity * ArrayElementSizes[arr->type];
+	buffer->data = arr->data;
+	arr->storage = ARRAY_SHARED;
+	arr->shared = buffer;
+	// the spare capacity now belongs to the buffer: nothing may grow into it
+	arr->capacity = arr->size;
+	return buffer;
+}
+
+Array* pushSharedArray(lua_State* lua, SharedBuffer* buffer)
+{
+	Array* arr = createArray(lua, 0, buffer->type);
+	retainSharedBuffer(buffer);
+	arr->storage = ARRAY_SHARED;
+	arr->shared = buffer;
+	arr->data = buffer->data;
+	arr->size = arr->capacity = buffer->size;
+	return arr;
+}
+
+void retainSharedBuffer(SharedBuffer* buffer)
+{
+	buffer->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+void releaseSharedBuffer(SharedBuffer* buffer)
+{
+	if (buffer->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+		return;
+	if (buffer->storage == ARRAY_MAPPED)
+		unmapFile(buffer->data, buffer->bytes);
+	else
+		freeBuffer(buffer->data, buffer->bytes);
+	delete buffer;
+}
+
+// arr:share() moves the elements out of the state so other states can wrap them; the array
+// keeps its elements but can no longer be resized
+struct ArrayShare {
+	template <typename T>
+	static int call(lua_State* lua, Array* arr)
+	{
+		releaseSharedBuffer(shareArray(lua, arr));
+		lua_settop(lua, 1);
+		return 1;
+	}
+};
+
+// arr:freeze() makes the array read-only for good; for a shared array that holds in every
+// state that wraps it
+struct ArrayFreeze {
+	template <typename T>
+	static int call(lua_State* lua, Array* arr)
+	{
+		arr->readonly = 1;
+		if (arr->storage == ARRAY_SHARED)
+			arr->shared->frozen.store(true, std::memory_order_release);
+		lua_settop(lua, 1);
+		return 1;
+	}
+};
+
+/* Views: O(1) slices that read and write the elements of their array in place */
+
+ArrayView* checkViewArg(lua_State* lua, int arg)
+{
+	luaL_argcheck(lua, isArrayMetatable(lua, arg, lua_upvalueindex(1)), arg, "expected an array view");
+	return (ArrayView*)lua_touserdata(lua, arg);
+}
+
+// pushes a view over arr, the array userdata at index parent
+ArrayView* pushView(lua_State* lua, int parent, Array* arr, size_t offset, size_t size, size_t stride)
+{
+	parent = lua_absindex(lua, parent);
+	ArrayView* view = (ArrayView*)lua_newuserdata(lua, sizeof(ArrayView));
+	view->array = arr;
+	view->offset = offset;
+	view->size = size;
+	view->stride = stride;
+	lua_rawgetp(lua, LUA_REGISTRYINDEX, &ArrayViewTypeKeys[arr->type]);
+	lua_setmetatable(lua, -2);
+	lua_pushvalue(lua, parent);
+	lua_setuservalue(lua, -2);
+	return view;
+}
+
+// reads the (first [, last [, step]]) arguments of slice for a sequence of the given size
+void checkSlice(lua_State* lua, size_t size, size_t* first, size_t* count, size_t* step)
+{
+	lua_Integer i = luaL_optinteger(lua, 2, 1);
+	lua_Integer j = luaL_optinteger(lua, 3, size);
+	lua_Integer k = luaL_optinteger(lua, 4, 1);
+	luaL_argcheck(lua, 0 < i && i <= (lua_Integer)size + 1, 2, "index out of range");
+	luaL_argcheck(lua, 0 <= j && j <= (lua_Integer)size, 3, "index out of range");
+	luaL_argcheck(lua, 0 < k, 4, "step must be positive");
+	*first = i - 1;
+	*count = j < i ? 0 : (j - i) / k + 1;
+	*step = k;
+}
+
+// position in the array of the i-th element of the view; the array may have shrunk since the view was made
+size_t viewIndex(lua_State* lua, ArrayView* view, lua_Integer i, int arg)
+{
+	luaL_argcheck(lua, 0 < i && i <= (lua_Integer)view->size, arg, "index out of range");
+	size_t index = view->offset + (size_t)(i - 1) * view->stride;
+	luaL_argcheck(lua, index < view->array->size, arg, "index out of range of the viewed array");
+	return index;
+}
+
+// arr:slice([first [, last [, step]]])
+struct ArraySlice {
+	template <typename T>
+	static int call(lua_State* lua, Array* arr)
+	{
+		size_t first, count, step;
+		checkSlice(lua, arr->size, &first, &count, &step);
+		pushView(lua, 1, arr, first, count, step);
+		return 1;
+	}
+};
 
-	lua_newtable(lua);
-	setfunction(array_new, "new");
-	setfunction(array_size, "size");
+// view:slice([first [, last [, step]]]) is a view of the same array
+int view_slice(lua_State* lua)
+{
+	ArrayView* view = checkViewArg(lua, 1);
+	size_t first, count, step;
+	checkSlice(lua, view->size, &first, &count, &step);
+	lua_getuservalue(lua, 1);
+	pushView(lua, -1, view->array, view->offset + first * view->stride, count, view->stride * step);
+	return 1;
+}
+
+// __index: integer keys read the elements, string keys find the methods table (upvalue 2)
+template <typename T>
+int view_get(lua_State* lua)
+{
+	ArrayView* view = checkViewArg(lua, 1);
+	if (lua_type(lua, 2) == LUA_TSTRING) {
+		lua_pushvalue(lua, 2);
+		lua_rawget(lua, lua_upvalueindex(2));
+		return 1;
+	}
+	size_t i = viewIndex(lua, view, luaL_checkinteger(lua, 2), 2);
+	ArrayElement<T>::push(lua, view->array, i);
+	return 1;
+}
+
+// __newindex
+template <typename T>
+int view_set(lua_State* lua)
+{
+	ArrayView* view = checkViewArg(lua, 1);
+	lua_Integer i = luaL_checkinteger(lua, 2);
+	typename ArrayElement<T>::Value v = ArrayElement<T>::check(lua, 3);
+	size_t index = viewIndex(lua, view, i, 2);
+	checkWritable(lua, view->array);
+	ArrayElement<T>::store(lua, view->array, index, v);
+	return 0;
+}
+
+// __len
+int view_size(lua_State* lua)
+{
+	ArrayView* view = checkViewArg(lua, 1);
+	lua_pushinteger(lua, view->size);
+	return 1;
+}
+
+// view:copy() returns a new array with the elements of the view
+template <typename T>
+int view_copy(lua_State* lua)
+{
+	ArrayView* view = checkViewArg(lua, 1);
+	Array* out = createArray(lua, view->size, view->array->type);
+	for (size_t i = 1; i <= view->size; i++) {
+		ArrayElement<T>::push(lua, view->array, viewIndex(lua, view, i, 1));
+		ArrayElement<T>::store(lua, out, i - 1, ArrayElement<T>::check(lua, -1));
+		lua_pop(lua, 1);
+	}
+	return 1;
+}
+
+// view:sum(); contiguous views run the array kernels
+template <typename T>
+int view_sum(lua_State* lua)
+{
+	ArrayView* view = checkViewArg(lua, 1);
+	if (view->size > 0)
+		viewIndex(lua, view, view->size, 1);
+	const T* data = elements<T>(view->array) + view->offset;
+	if (view->stride == 1) {
+		pushAccumulator(lua, sumElements(data, view->size));
+		return 1;
+	}
+	typedef typename Wrapping<typename Accumulator<T>::type>::type Sum;
+	Sum s = 0;
+	for (size_t i = 0; i < view->size; i++)
+		s += (Sum)data[i * view->stride];
+	pushAccumulator(lua, (typename Accumulator<T>::type)s);
+	return 1;
+}
+
+// string views have none of the numeric methods
+template <typename T>
+void setNumericViewMethods(lua_State* lua, int metatable)
+{
+	lua_pushvalue(lua, metatable);
+	lua_pushcclosure(lua, view_sum<T>, 1);
+	lua_setfield(lua, -2, "sum");
+}
+
+template <>
+void setNumericViewMethods<ArrayString>(lua_State* lua, int metatable)
+{
+}
+
+// fills the view metatable on the top of the stack
+template <typename T>
+void setViewMetamethods(lua_State* lua)
+{
+	const luaL_Reg metamethods[] = {
+		{"__newindex", view_set<T>},
+		{"__len", view_size},
+		{NULL, NULL}
+	};
+	const luaL_Reg methods[] = {
+		{"size", view_size},
+		{"slice", view_slice},
+		{"copy", view_copy<T>},
+		{NULL, NULL}
+	};
+	int metatable = lua_gettop(lua);
+	lua_pushvalue(lua, metatable);
+	luaL_setfuncs(lua, metamethods, 1);
+
+	lua_pushvalue(lua, metatable);
+		lua_newtable(lua); // methods
+		lua_pushvalue(lua, metatable);
+		luaL_setfuncs(lua, methods, 1);
+		setNumericViewMethods<T>(lua, metatable);
+	lua_pushcclosure(lua, view_get<T>, 2);
+	lua_setfield(lua, metatable, "__index");
+}
+
+template <typename T>
+const luaL_Reg* arrayMethods()
+{
+	static const luaL_Reg methods[] = {
+		{"size", array_method<T, ArraySize>},
+		{"add", array_method<T, ArrayAdd>},
+		{"insert", array_method<T, ArrayInsert>},
+		{"remove", array_method<T, ArrayRemove>},
+		{"assign", array_method<T, ArrayAssign>},
+		{"foreach", array_method<T, ArrayForeach>},
+		{"map", array_method<T, ArrayMap>},
+		{"filter", array_method<T, ArrayFilter>},
+		{"reduce", array_method<T, ArrayReduce>},
+		{"slice", array_method<T, ArraySlice>},
+		{"share", array_method<T, ArrayShare>},
+		{"freeze", array_method<T, ArrayFreeze>},
+		{NULL, NULL}
+	};
+	return methods;
+}
+
+template <typename T>
+const luaL_Reg* numericArrayMethods()
+{
+	static const luaL_Reg methods[] = {
+		{"sum", array_method<T, ArraySum>},
+		{"dot", array_method<T, ArrayDot>},
+		{"scale", array_method<T, ArrayScale>},
+		{"axpy", array_method<T, ArrayAxpy>},
+		{"minmax", array_method<T, ArrayMinMax>},
+		{"min", array_method<T, ArrayExtreme<0> >},
+		{"max", array_method<T, ArrayExtreme<1> >},
+		{NULL, NULL}
+	};
+	return methods;
+}
+
+// string arrays have none of the numeric methods
+template <typename T>
+void setNumericMethods(lua_State* lua, int metatable)
+{
+	lua_pushvalue(lua, metatable);
+	luaL_setfuncs(lua, numericArrayMethods<T>(), 1);
+}
+
+template <>
+void setNumericMethods<ArrayString>(lua_State* lua, int metatable)
+{
+}
+
+const luaL_Reg array_functions[] = {
+	{"new", array_new},
+	{"number", array_of<double>},
+	{"float32", array_of<float>},
+	{"int32", array_of<int32_t>},
+	{"int64", array_of<int64_t>},
+	{"uint8", array_of<uint8_t>},
+	{"string", array_of<ArrayString>},
+	{"fromtable", array_fromtable},
+	{"frombytes", array_frombytes},
+	{"fromfile", array_fromfile},
+	{"mmap", array_mmap},
+	{"size", array_function<ArraySize>},
+	{"add", array_function<ArrayAdd>},
+	{"insert", array_function<ArrayInsert>},
+	{"remove", array_function<ArrayRemove>},
+	{"assign", array_function<ArrayAssign>},
+	{"foreach", array_function<ArrayForeach>},
+	{"map", array_function<ArrayMap>},
+	{"filter", array_function<ArrayFilter>},
+	{"reduce", array_function<ArrayReduce>},
+	{"slice", array_function<ArraySlice>},
+	{"share", array_function<ArrayShare>},
+	{"freeze", array_function<ArrayFreeze>},
+	{NULL, NULL}
+};
+
+// fills the metatable on the top of the stack
+template <typename T>
+void setArrayMetamethods(lua_State* lua)
+{
+	const luaL_Reg metamethods[] = {
+		{"__newindex", array_set<T>},
+		{"__len", array_method<T, ArraySize>},
+		{"__gc", array_free},
+		{NULL, NULL}
+	};
+	int metatable = lua_gettop(lua);
+	lua_pushvalue(lua, metatable);
+	luaL_setfuncs(lua, metamethods, 1);
+
+	lua_pushvalue(lua, metatable);
+		lua_newtable(lua); // methods
+		lua_pushvalue(lua, metatable);
+		luaL_setfuncs(lua, arrayMethods<T>(), 1);
+		setNumericMethods<T>(lua, metatable);
+	lua_pushcclosure(lua, array_get<T>, 2);
+	lua_setfield(lua, metatable, "__index");
+}
+
+template <typename T>
+void newArrayMetatable(lua_State* lua)
+{
+	ArrayType type = ArrayTypeOf<T>::value;
+	std::string name = std::string("Array.") + ArrayTypeNames[type];
+	if (luaL_newmetatable(lua, name.c_str())) {
+		setArrayMetamethods<T>(lua);
+		lua_pushvalue(lua, -1);
+		lua_rawsetp(lua, LUA_REGISTRYINDEX, &ArrayTypeKeys[type]);
+
+		lua_rawgetp(lua, LUA_REGISTRYINDEX, &ArrayKey);
+		lua_pushvalue(lua, -2);
+		lua_pushinteger(lua, type);
+		lua_rawset(lua, -3);
+		lua_pop(lua, 1);
+	}
+	lua_pop(lua, 1);
+
+	name = std::string("ArrayView.") + ArrayTypeNames[type];
+	if (luaL_newmetatable(lua, name.c_str())) {
+		setViewMetamethods<T>(lua);
+		lua_pushvalue(lua, -1);
+		lua_rawsetp(lua, LUA_REGISTRYINDEX, &ArrayViewTypeKeys[type]);
+	}
+	lua_pop(lua, 1);
+}
+
+// registers the metatables shared by every array of the state
+void newArrayMetatables(lua_State* lua)
+{
+	if (lua_rawgetp(lua, LUA_REGISTRYINDEX, &ArrayKey) == LUA_TNIL) {
+		lua_newtable(lua);
+		lua_rawsetp(lua, LUA_REGISTRYINDEX, &ArrayKey);
+	}
+	lua_pop(lua, 1);
+
+	newArrayMetatable<double>(lua);
+	newArrayMetatable<float>(lua);
+	newArrayMetatable<int32_t>(lua);
+	newArrayMetatable<int64_t>(lua);
+	newArrayMetatable<uint8_t>(lua);
+	newArrayMetatable<ArrayString>(lua);
+}
+
+// sets the global array table
+void openArray(lua_State* lua)
+{
+	newArrayMetatables(lua);
+
+	luaL_newlib(lua, array_functions);
 		lua_newtable(lua);
 		setfunction(array_make, "__call");
-	lua_setmetatable(lua, 1);
+	lua_setmetatable(lua, -2);
 
 	lua_setglobal(lua, "array");
+}
+
+void usingUserdata(lua_State* lua)
+{
+	lua_settop(lua, 0);
+
+	openArray(lua);
 
 	lua_getglobal(lua, "useArray");
 	if(lua_pcall(lua, 0, 0, 0)) {
 		puts(lua_tostring(lua, -1));
 	}
 }
+
+/************* Benchmarking array allocation **************/
+
+typedef struct {
+	size_t allocations;
+} AllocCounter;
+
+void* countingAlloc(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+	if (nsize == 0) {
+		free(ptr);
+		return NULL;
+	}
+	if (ptr == NULL)
+		((AllocCounter*)ud)->allocations++;
+	return realloc(ptr, nsize);
+}
+
+// how createArray used to work: a fresh metatable and its closures for every array
+Array* createArrayOwnMetatable(lua_State* lua, size_t size)
+{
+	Array* arr = (Array*)lua_newuserdata(lua, sizeof(Array));
+	memset(arr, 0, sizeof(Array));
+		lua_newtable(lua);
+		setArrayMetamethods<double>(lua);
+	lua_setmetatable(lua, -2);
+	reserveArray(lua, arr, size);
+	arr->size = size;
+	return arr;
+}
+
+void benchmarkCreate(const char* name, Array* (*create)(lua_State*, size_t), size_t count)
+{
+	AllocCounter counter = {0};
+	lua_State* lua = lua_newstate(countingAlloc, &counter);
+	newArrayMetatables(lua);
+	size_t before = counter.allocations;
+
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < count; i++) {
+		create(lua, 4);
+		lua_pop(lua, 1);
+	}
+	lua_gc(lua, LUA_GCCOLLECT, 0);
+	auto elapsed = std::chrono::steady_clock::now() - start;
+
+	double ns = std::chrono::duration<double, std::nano>(elapsed).count();
+	printf("%-20s %6.2f allocations/array %8.1f ns/array\n", name,
+		(double)(counter.allocations - before) / count, ns / count);
+	lua_close(lua);
+}
+
+void benchmarkArrayAllocation(size_t count)
+{
+	benchmarkCreate("per-array metatable", createArrayOwnMetatable, count);
+	benchmarkCreate("shared metatable", [](lua_State* lua, size_t size) { return createArray(lua, size); }, count);
+}
+
+/************* Benchmarking array access **************/
+
+// runs bench-array.lua, which compares arrays against plain Lua tables
+void benchmarkArrayAccess()
+{
+	lua_State* lua = luaL_newstate();
+	luaL_openlibs(lua);
+	openArray(lua);
+
+	if (luaL_dofile(lua, "bench-array.lua")) {
+		puts(lua_tostring(lua, -1));
+	}
+
+	lua_close(lua);
+}
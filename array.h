@@ -0,0 +1,109 @@
+#ifndef ARRAY_H
+#define ARRAY_H
+
+#include <lua.hpp>
+#include <stdint.h>
+#include <atomic>
+
+typedef enum {
+	ARRAY_NUMBER,  // double
+	ARRAY_FLOAT32,
+	ARRAY_INT32,
+	ARRAY_INT64,
+	ARRAY_UINT8,
+	ARRAY_STRING,
+	ARRAY_TYPES
+} ArrayType;
+
+// element of a string array: a range of bytes in the array's arena
+typedef struct {
+	size_t offset;
+	size_t length;
+} ArrayString;
+
+// bytes of every element of a string array, stored back to back
+typedef struct {
+	char* bytes;
+	size_t size;
+	size_t capacity;
+	size_t garbage; // bytes no element refers to anymore
+} StringArena;
+
+typedef enum {
+	ARRAY_HEAP,   // buffer grown by reserveArray; large ones are huge-page aligned
+	ARRAY_MAPPED, // pages of a file mapped by array.mmap; cannot be resized
+	ARRAY_SHARED  // a SharedBuffer other states may wrap too; cannot be resized
+} ArrayStorage;
+
+// Elements that live outside any lua_State so that arrays in several states, and on
+// several threads, can wrap the same memory. The last array to drop its reference frees
+// the buffer. Once frozen no array can write to it, so concurrent reads need no locks.
+typedef struct {
+	std::atomic<size_t> refs;
+	std::atomic<bool> frozen;
+	ArrayType type;
+	ArrayStorage storage; // ARRAY_HEAP or ARRAY_MAPPED: how data is released
+	size_t size;          // elements
+	size_t bytes;         // allocated or mapped bytes
+	void* data;
+} SharedBuffer;
+
+typedef struct {
+	size_t size;
+	size_t capacity;
+	ArrayType type;
+	ArrayStorage storage;
+	int readonly;
+	void* data;
+	StringArena strings;  // string arrays only
+	SharedBuffer* shared; // ARRAY_SHARED only; one reference held by this array
+} Array;
+
+// a window over an array with an offset and a stride; the array is kept alive by the view's uservalue
+typedef struct {
+	Array* array;
+	size_t offset;
+	size_t size;
+	size_t stride;
+} ArrayView;
+
+template <typename T>
+inline T* elements(Array* arr)
+{
+	return (T*)arr->data;
+}
+
+// registers the metatable of every array type; must run before any array is created
+void newArrayMetatables(lua_State* lua);
+
+// registers the metatables and sets the global array table
+void openArray(lua_State* lua);
+
+// pushes a new zero-filled array with the given size onto the stack
+Array* createArray(lua_State* lua, size_t size, ArrayType type = ARRAY_NUMBER);
+
+// returns the array at the given index, or NULL if the value is not an array
+Array* toArray(lua_State* lua, int index);
+
+// like toArray but raises an argument error if the value is not an array
+Array* checkArray(lua_State* lua, int index);
+
+// size in bytes of one element of each array type
+extern const size_t ArrayElementSizes[];
+
+// copies bytes into the arena of a string array and returns their offset
+size_t internString(lua_State* lua, Array* arr, const char* s, size_t length);
+
+// moves the elements of arr into a SharedBuffer without copying them, if they are not
+// there already, and returns a new reference to it; string arrays cannot be shared
+SharedBuffer* shareArray(lua_State* lua, Array* arr);
+
+// pushes a new array that wraps the buffer and holds its own reference to it
+Array* pushSharedArray(lua_State* lua, SharedBuffer* buffer);
+
+void retainSharedBuffer(SharedBuffer* buffer);
+
+// drops a reference; the last one frees the elements
+void releaseSharedBuffer(SharedBuffer* buffer);
+
+#endif
@@ -0,0 +1,118 @@
+local N = 10000000
+
+local function bench(name, f)
+    local start = os.clock()
+    local result = f()
+    local elapsed = os.clock() - start
+    print(string.format("%-24s %8.2f ns/op  (%s)", name, elapsed * 1e9 / N, tostring(result)))
+end
+
+local size = 1000
+local tbl = {}
+local arr = array.new(size)
+for i = 1, size do
+    tbl[i] = i
+    arr[i] = i
+end
+
+-- a plain table with its methods behind __index, like the array methods
+local Counter = {}
+Counter.__index = Counter
+function Counter:add(v) self.n = self.n + v end
+local counter = setmetatable({n = 0}, Counter)
+
+bench("table index", function()
+    local sum = 0
+    for i = 1, N do
+        sum = sum + tbl[i % size + 1]
+    end
+    return sum
+end)
+
+bench("array index", function()
+    local sum = 0
+    for i = 1, N do
+        sum = sum + arr[i % size + 1]
+    end
+    return sum
+end)
+
+bench("table method call", function()
+    for i = 1, N do
+        counter:add(1)
+    end
+    return counter.n
+end)
+
+bench("array method call", function()
+    local grow = array.new(0)
+    for i = 1, N do
+        grow:add(i)
+    end
+    return #grow
+end)
+
+-- bulk kernels against the equivalent Lua loops, in elements per second
+local M = 1000000
+local xs = array.new(M)
+local ys = array.new(M)
+for i = 1, M do
+    xs[i] = i % 97
+    ys[i] = i % 89
+end
+
+local function throughput(name, rounds, f)
+    local start = os.clock()
+    local result
+    for _ = 1, rounds do
+        result = f()
+    end
+    local elapsed = os.clock() - start
+    print(string.format("%-24s %10.1f M elements/s  (%s)", name, rounds * M / elapsed / 1e6, tostring(result)))
+end
+
+throughput("lua loop sum", 10, function()
+    local sum = 0
+    for i = 1, #xs do
+        sum = sum + xs[i]
+    end
+    return sum
+end)
+throughput("arr:sum()", 200, function() return xs:sum() end)
+
+throughput("lua loop dot", 10, function()
+    local sum = 0
+    for i = 1, #xs do
+        sum = sum + xs[i] * ys[i]
+    end
+    return sum
+end)
+throughput("arr:dot()", 200, function() return xs:dot(ys) end)
+
+throughput("lua loop axpy", 10, function()
+    for i = 1, #ys do
+        ys[i] = ys[i] + 0.5 * xs[i]
+    end
+end)
+throughput("arr:axpy()", 200, function() ys:axpy(0.5, xs) end)
+
+throughput("lua loop scale", 10, function()
+    for i = 1, #ys do
+        ys[i] = ys[i] * 0.5
+    end
+end)
+throughput("arr:scale()", 200, function() ys:scale(0.5) end)
+
+throughput("lua loop minmax", 10, function()
+    local lo, hi = xs[1], xs[1]
+    for i = 2, #xs do
+        local v = xs[i]
+        if v < lo then lo = v end
+        if v > hi then hi = v end
+    end
+    return lo .. " " .. hi
+end)
+throughput("arr:minmax()", 200, function()
+    local lo, hi = xs:minmax()
+    return lo .. " " .. hi
+end)
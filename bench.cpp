@@ -0,0 +1,453 @@
+#include "array.h"
+#include "state_pool.h"
+#include "executor.h"
+#include "state_alloc.h"
+#include "chunk_cache.h"
+#include "snippet_cache.h"
+#include "lua_function.h"
+#include "lua_bind.h"
+#include "protected_call.h"
+#include "scheduler.h"
+#include "channel.h"
+#include <stdio.h>
+#include <vector>
+#include <string>
+#include <thread>
+#include <chrono>
+
+// Benchmarks of the modules built around the array library; array.cpp keeps the benchmarks
+// of the array module itself. Build with make-bench.bat.
+
+void benchmarkStatePool(size_t jobs);
+void benchmarkExecutor(size_t jobs);
+void benchmarkAllocator(size_t count);
+void benchmarkChunkCache(const char* path, size_t count);
+void benchmarkSnippetCache(size_t count, size_t distinct);
+void benchmarkLuaFunction(size_t count);
+void benchmarkBind(size_t count);
+void benchmarkProtectedCall(size_t count);
+void benchmarkScheduler(size_t tasks);
+void benchmarkChannel(size_t count);
+
+int main()
+{
+	// benchmarkStatePool(100000);
+	// benchmarkExecutor(1000);
+	// benchmarkAllocator(1000000);
+	// benchmarkChunkCache("bench-array.lua", 10000);
+	// benchmarkSnippetCache(1000000, 100);
+	// benchmarkLuaFunction(10000000);
+	// benchmarkBind(10000000);
+	// benchmarkProtectedCall(1000000);
+	// benchmarkScheduler(10000);
+	// benchmarkChannel(1000000);
+}
+
+/************* Benchmarking state pool **************/
+
+// a job as small as a request handler: set a global and sum an array
+static const char* PoolJob =
+	"counter = (counter or 0) + 1\n"
+	"local a = array.number(1, 2, 3, 4)\n"
+	"return a:sum()";
+
+void runPoolJob(lua_State* lua)
+{
+	if (luaL_dostring(lua, PoolJob))
+		puts(lua_tostring(lua, -1));
+	lua_settop(lua, 0);
+}
+
+// compares a fresh state per job against states leased from a StatePool
+void benchmarkStatePool(size_t jobs)
+{
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < jobs; i++) {
+		lua_State* lua = luaL_newstate();
+		luaL_openlibs(lua);
+		openArray(lua);
+		runPoolJob(lua);
+		lua_close(lua);
+	}
+	double fresh = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+	StatePool pool(4, openArray);
+	start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < jobs; i++) {
+		StatePool::Lease lua(pool);
+		runPoolJob(lua);
+	}
+	double pooled = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+	StatePoolMetrics m = pool.metrics();
+	printf("%-12s %8.2f us/job\n", "fresh state", fresh / jobs);
+	printf("%-12s %8.2f us/job\n", "pooled state", pooled / jobs);
+	printf("leases %llu, reuses %llu, waits %llu, wait %.3f ms (max %.3f ms)\n",
+		(unsigned long long)m.leases, (unsigned long long)m.reuses, (unsigned long long)m.waits,
+		m.waitSeconds * 1e3, m.maxWaitSeconds * 1e3);
+}
+
+/************* Benchmarking executor **************/
+
+// an independent, CPU-bound script that returns an Array
+static const char* ExecutorJob =
+	"local n = ...\n"
+	"local a = array.new(n)\n"
+	"for i = 1, n do a[i] = math.sin(i) end\n"
+	"a:scale(2)\n"
+	"return a:sum(), a";
+
+// runs the jobs one after another on a single state, then on Executors with every core
+void benchmarkExecutor(size_t jobs)
+{
+	const lua_Integer n = 100000;
+
+	lua_State* lua = luaL_newstate();
+	luaL_openlibs(lua);
+	openArray(lua);
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < jobs; i++) {
+		luaL_loadstring(lua, ExecutorJob);
+		lua_pushinteger(lua, n);
+		if (lua_pcall(lua, 1, 2, 0))
+			puts(lua_tostring(lua, -1));
+		lua_settop(lua, 0);
+	}
+	double single = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	lua_close(lua);
+
+	printf("%-20s %8.3f s\n", "single state", single);
+
+	// warm per-worker states, then states reset to their setup globals after every job
+	for (bool isolate : {false, true}) {
+		Executor executor(0, openArray, 0, isolate);
+		start = std::chrono::steady_clock::now();
+		std::vector<std::future<ScriptResult>> results;
+		for (size_t i = 0; i < jobs; i++)
+			results.push_back(executor.run(ExecutorJob, {n}));
+		for (auto& result : results) {
+			ScriptResult r = result.get();
+			if (!r.ok)
+				puts(r.error.c_str());
+		}
+		double parallel = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		ExecutorMetrics m = executor.metrics();
+		printf("%-20s %8.3f s (%zu workers, %llu steals)\n", isolate ? "executor, isolated" : "executor", parallel,
+			executor.size(), (unsigned long long)m.steals);
+	}
+}
+
+/************* Benchmarking allocator **************/
+
+// small table and closure churn, like vector tables and counter closures
+static const char* ChurnJob =
+	"local n = ...\n"
+	"local function counter() local c = 0 return function() c = c + 1 return c end end\n"
+	"local sum = 0\n"
+	"for i = 1, n do\n"
+	"  local v = {x = i, y = i}\n"
+	"  sum = sum + v.x + counter()()\n"
+	"end\n"
+	"return sum";
+
+void runChurn(const char* name, lua_State* lua, size_t count)
+{
+	luaL_openlibs(lua);
+	auto start = std::chrono::steady_clock::now();
+	luaL_loadstring(lua, ChurnJob);
+	lua_pushinteger(lua, count);
+	if (lua_pcall(lua, 1, 1, 0))
+		puts(lua_tostring(lua, -1));
+	double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+	printf("%-20s %8.1f ns/iteration\n", name, ns / count);
+}
+
+void benchmarkAllocator(size_t count)
+{
+	lua_State* lua = luaL_newstate();
+	runChurn("default allocator", lua, count);
+	lua_close(lua);
+
+	StateAllocator allocator;
+	lua = allocator.newState();
+	runChurn("state allocator", lua, count);
+	StateAllocatorStats stats = allocator.statistics();
+	printf("live %zu, peak %zu, arena %zu bytes; %llu pooled, %llu malloc\n", stats.live, stats.peak,
+		stats.arena, (unsigned long long)stats.pooled, (unsigned long long)stats.system);
+	lua_close(lua);
+
+	// a runaway script fails with a memory error instead of taking the process down
+	StateAllocator capped(8 * 1024 * 1024);
+	lua = capped.newState();
+	luaL_openlibs(lua);
+	if (luaL_dostring(lua, "local t = {} for i = 1, 1e8 do t[i] = i end"))
+		printf("capped at %zu bytes: %s\n", capped.statistics().limit, lua_tostring(lua, -1));
+	lua_close(lua);
+}
+
+/************* Benchmarking chunk cache **************/
+
+// loads a script count times with luaL_loadfile, then through a ChunkCache
+void benchmarkChunkCache(const char* path, size_t count)
+{
+	lua_State* lua = luaL_newstate();
+
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < count; i++) {
+		if (luaL_loadfile(lua, path) != LUA_OK)
+			puts(lua_tostring(lua, -1));
+		lua_settop(lua, 0);
+	}
+	double parsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+	ChunkCache cache;
+	start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < count; i++) {
+		if (cache.loadFile(lua, path) != LUA_OK)
+			puts(lua_tostring(lua, -1));
+		lua_settop(lua, 0);
+	}
+	double cached = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+	ChunkCacheStats stats = cache.statistics();
+	printf("%-16s %8.2f us/load\n", "luaL_loadfile", parsed / count);
+	printf("%-16s %8.2f us/load (%llu compiles, %llu hits, %zu bytes of bytecode)\n", "chunk cache", cached / count,
+		(unsigned long long)stats.compiles, (unsigned long long)stats.hits, stats.bytes);
+	lua_close(lua);
+}
+
+/************* Benchmarking snippet cache **************/
+
+// evaluates count generated expressions drawn from distinct different sources
+void benchmarkSnippetCache(size_t count, size_t distinct)
+{
+	std::vector<std::string> snippets;
+	for (size_t i = 0; i < distinct; i++)
+		snippets.push_back("local x = ... return x * " + std::to_string(i) + " + 1");
+
+	lua_State* lua = luaL_newstate();
+	luaL_openlibs(lua);
+
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < count; i++) {
+		luaL_loadstring(lua, snippets[i % distinct].c_str());
+		lua_pushinteger(lua, i);
+		lua_call(lua, 1, 1);
+		lua_pop(lua, 1);
+	}
+	double parsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+	SnippetCache cache(lua, distinct);
+	start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < count; i++) {
+		cache.load(snippets[i % distinct].c_str());
+		lua_pushinteger(lua, i);
+		lua_call(lua, 1, 1);
+		lua_pop(lua, 1);
+	}
+	double cached = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+	SnippetCacheStats stats = cache.statistics();
+	printf("%-16s %8.1f ns/eval\n", "luaL_loadstring", parsed / count);
+	printf("%-16s %8.1f ns/eval (%llu hits, %llu misses)\n", "snippet cache", cached / count,
+		(unsigned long long)stats.hits, (unsigned long long)stats.misses);
+	cache.clear();
+	lua_close(lua);
+}
+
+/************* Benchmarking Lua function calls **************/
+
+// calls a Lua hook count times, looked up by name on every call and then through a LuaFunction
+void benchmarkLuaFunction(size_t count)
+{
+	lua_State* lua = luaL_newstate();
+	luaL_openlibs(lua);
+	luaL_dostring(lua, "function hook(a, b) return a + b end");
+
+	double sum = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < count; i++) {
+		lua_getglobal(lua, "hook");
+		lua_pushnumber(lua, (double)i);
+		lua_pushnumber(lua, 1);
+		if (lua_pcall(lua, 2, 1, 0) != LUA_OK)
+			puts(lua_tostring(lua, -1));
+		sum += lua_tonumber(lua, -1);
+		lua_pop(lua, 1);
+	}
+	double global = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+	LuaFunction<double(double, double)> hook(lua, "hook");
+	start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < count; i++)
+		sum += hook((double)i, 1);
+	double pinned = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+	printf("%-20s %8.1f ns/call\n", "lua_getglobal", global / count);
+	printf("%-20s %8.1f ns/call (%g)\n", "LuaFunction", pinned / count, sum);
+	hook = LuaFunction<double(double, double)>();
+	lua_close(lua);
+}
+
+/************* Benchmarking bound C functions **************/
+
+static double addNumbers(double a, double b)
+{
+	return a + b;
+}
+
+static int lualib_add(lua_State* lua)
+{
+	double a = luaL_checknumber(lua, 1);
+	double b = luaL_checknumber(lua, 2);
+	lua_pushnumber(lua, a + b);
+	return 1;
+}
+
+// calls a hand-written lua_CFunction and the one bind generates for the same function from a Lua loop
+void benchmarkBind(size_t count)
+{
+	lua_State* lua = luaL_newstate();
+	luaL_openlibs(lua);
+	lua_register(lua, "handwritten", lualib_add);
+	lua_register(lua, "bound", LUA_BIND(addNumbers));
+	lua_pushinteger(lua, (lua_Integer)count);
+	lua_setglobal(lua, "count");
+
+	const char* names[] = {"handwritten", "bound"};
+	for (const char* name : names) {
+		std::string loop = std::string("local f, s = ") + name + ", 0 for i = 1, count do s = f(s, 1) end return s";
+		auto start = std::chrono::steady_clock::now();
+		if (luaL_dostring(lua, loop.c_str()) != LUA_OK)
+			puts(lua_tostring(lua, -1));
+		double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+		printf("%-12s %8.1f ns/call (%g)\n", name, elapsed / count, lua_tonumber(lua, -1));
+		lua_pop(lua, 1);
+	}
+	lua_close(lua);
+}
+
+/************* Benchmarking protected calls **************/
+
+// the message handler of lua.c: formats a traceback on every error
+static int tracebackHandler(lua_State* lua)
+{
+	luaL_traceback(lua, lua, lua_tostring(lua, 1), 1);
+	return 1;
+}
+
+// calls a failing script count times: without a handler, with an eager traceback and through ProtectedCalls
+void benchmarkProtectedCall(size_t count)
+{
+	lua_State* lua = luaL_newstate();
+	luaL_openlibs(lua);
+	luaL_dostring(lua, "function field(t) return t.x end function script() return field(nil) end");
+
+	lua_getglobal(lua, "script");
+	int script = lua_gettop(lua);
+	size_t failures = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < count; i++) {
+		lua_pushvalue(lua, script);
+		if (lua_pcall(lua, 0, 0, 0)) {
+			failures += lua_tostring(lua, -1) != NULL;
+			lua_pop(lua, 1);
+		}
+	}
+	double plain = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+	lua_pushcfunction(lua, tracebackHandler);
+	int handler = lua_gettop(lua);
+	start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < count; i++) {
+		lua_pushvalue(lua, script);
+		if (lua_pcall(lua, 0, 0, handler)) {
+			failures += lua_tostring(lua, -1) != NULL;
+			lua_pop(lua, 1);
+		}
+	}
+	double traced = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+	printf("%-20s %8.1f ns/error\n", "no handler", plain / count);
+	printf("%-20s %8.1f ns/error\n", "luaL_traceback", traced / count);
+
+	// a ProtectedCall that records the failing line only, then one that keeps every frame
+	for (bool traceback : {false, true}) {
+		ProtectedCall pcall(lua, traceback);
+		start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < count; i++) {
+			lua_pushvalue(lua, script);
+			if (pcall.call(0, 0))
+				failures += pcall.error().line() > 0;
+		}
+		double captured = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+		printf("%-20s %8.1f ns/error (%zu failures)\n", traceback ? "ProtectedCall traced" : "ProtectedCall",
+			captured / count, failures);
+		printf("%s\n%s\n", pcall.error().message(), pcall.error().traceback().c_str());
+	}
+	lua_close(lua);
+}
+
+/************* Benchmarking the scheduler **************/
+
+// runs that many producer and consumer pairs, each passing 100 values through a channel, in one thread
+void benchmarkScheduler(size_t tasks)
+{
+	lua_State* lua = luaL_newstate();
+	luaL_openlibs(lua);
+	{
+		Scheduler scheduler(lua);
+		lua_pushinteger(lua, (lua_Integer)tasks);
+		lua_setglobal(lua, "tasks");
+		luaL_dostring(lua,
+			"for i = 1, tasks do\n"
+			"	local channel = async.channel(8)\n"
+			"	async.spawn(function() for v = 1, 100 do channel:send(v) end end)\n"
+			"	async.spawn(function() local sum = 0 for v = 1, 100 do sum = sum + channel:recv() end end)\n"
+			"end");
+
+		auto start = std::chrono::steady_clock::now();
+		scheduler.run();
+		double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		SchedulerMetrics metrics = scheduler.metrics();
+		printf("%zu tasks: %.3f s, %.0f resumes/s, %.1f KB of Lua memory at the end\n", (size_t)metrics.spawned,
+			elapsed, metrics.resumes / elapsed, lua_gc(lua, LUA_GCCOUNT, 0) + lua_gc(lua, LUA_GCCOUNTB, 0) / 1024.0);
+	}
+	lua_close(lua);
+}
+
+/************* Benchmarking channels **************/
+
+// sends count integers from a state on one thread to a state on another
+void benchmarkChannel(size_t count)
+{
+	Channel* channel = new Channel(256);
+	auto start = std::chrono::steady_clock::now();
+	std::thread producer([channel, count] {
+		lua_State* lua = luaL_newstate();
+		luaL_openlibs(lua);
+		openChannel(lua);
+		pushChannel(lua, channel);
+		lua_setglobal(lua, "out");
+		lua_pushinteger(lua, (lua_Integer)count);
+		lua_setglobal(lua, "count");
+		if (luaL_dostring(lua, "for i = 1, count do out:send(i) end out:close()"))
+			puts(lua_tostring(lua, -1));
+		lua_close(lua);
+	});
+
+	lua_State* lua = luaL_newstate();
+	luaL_openlibs(lua);
+	openChannel(lua);
+	pushChannel(lua, channel);
+	lua_setglobal(lua, "input");
+	if (luaL_dostring(lua, "local sum = 0 while true do local v, ok = input:recv() if not ok then break end sum = sum + v end return sum"))
+		puts(lua_tostring(lua, -1));
+	producer.join();
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	printf("%zu values: %.3f s, %.0f values/s (sum %lld)\n", count, elapsed, count / elapsed, (long long)lua_tointeger(lua, -1));
+	lua_close(lua);
+	channel->release();
+}
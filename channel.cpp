@@ -0,0 +1,608 @@
+#include "channel.h"
+#include <unordered_map>
+#include <vector>
+
+/************* Channel **************/
+
+Channel::Channel(size_t capacity)
+{
+	// one cell could not tell a full ring from an empty one
+	size_t size = 2;
+	while (size < capacity)
+		size *= 2;
+	cells = new Cell[size];
+	for (size_t i = 0; i < size; i++)
+		cells[i].sequence.store(i, std::memory_order_relaxed);
+	mask = size - 1;
+	tail.store(0, std::memory_order_relaxed);
+	head.store(0, std::memory_order_relaxed);
+	refs.store(1, std::memory_order_relaxed);
+	isClosed.store(false, std::memory_order_relaxed);
+	senders.count.store(0, std::memory_order_relaxed);
+	senders.blocked = 0;
+	receivers.count.store(0, std::memory_order_relaxed);
+	receivers.blocked = 0;
+}
+
+Channel::~Channel()
+{
+	delete[] cells;
+}
+
+void Channel::retain()
+{
+	refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Channel::release()
+{
+	if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		delete this;
+}
+
+// A cell is free to send to when its sequence equals the position, and holds a value
+// when it equals the position + 1; receiving sets it to the position of the next lap.
+bool Channel::push(ScriptValue& value)
+{
+	size_t position = tail.load(std::memory_order_relaxed);
+	for (;;) {
+		Cell& cell = cells[position & mask];
+		size_t sequence = cell.sequence.load(std::memory_order_acquire);
+		intptr_t lag = (intptr_t)sequence - (intptr_t)position;
+		if (lag == 0) {
+			if (tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+				cell.value = std::move(value);
+				cell.sequence.store(position + 1, std::memory_order_release);
+				return true;
+			}
+		}
+		else if (lag < 0) {
+			return false; // a lap behind: full
+		}
+		else {
+			position = tail.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+bool Channel::pop(ScriptValue* value)
+{
+	size_t position = head.load(std::memory_order_relaxed);
+	for (;;) {
+		Cell& cell = cells[position & mask];
+		size_t sequence = cell.sequence.load(std::memory_order_acquire);
+		intptr_t lag = (intptr_t)sequence - (intptr_t)(position + 1);
+		if (lag == 0) {
+			if (head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+				*value = std::move(cell.value);
+				cell.sequence.store(position + mask + 1, std::memory_order_release);
+				return true;
+			}
+		}
+		else if (lag < 0) {
+			return false; // empty
+		}
+		else {
+			position = head.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+static int wakeTask(lua_State* thread, void* data)
+{
+	(void)thread;
+	(void)data;
+	return 0;
+}
+
+// Wakes a blocked thread and a queued task of the side after a send or receive made
+// progress for it. Waking one of each is never wrong, as woken waiters try again, and
+// it cannot miss a task behind a thread that was already signalled. A task whose
+// scheduler is gone cannot take the wake, so it passes to the next task.
+void Channel::notify(Waiters& side)
+{
+	// pairs with the fence of a waiter: either it sees the progress, or this sees it
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (side.count.load(std::memory_order_relaxed) == 0)
+		return;
+	bool signal = true;
+	for (;;) {
+		Waiter waiter;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (signal && side.blocked > 0)
+				side.signal.notify_one();
+			signal = false;
+			if (side.tasks.empty())
+				return;
+			waiter = std::move(side.tasks.front());
+			side.tasks.pop_front();
+			side.count--;
+		}
+		if (waiter.scheduler->post(waiter.task, wakeTask, NULL))
+			return;
+	}
+}
+
+bool Channel::trySend(ScriptValue& value)
+{
+	if (!push(value))
+		return false;
+	notify(receivers);
+	return true;
+}
+
+bool Channel::tryReceive(ScriptValue* value)
+{
+	if (!pop(value))
+		return false;
+	notify(senders);
+	return true;
+}
+
+bool Channel::send(ScriptValue& value)
+{
+	for (;;) {
+		if (closed())
+			return false;
+		if (trySend(value))
+			return true;
+		std::unique_lock<std::mutex> lock(mutex);
+		senders.count++;
+		senders.blocked++;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		bool sent = !closed() && push(value);
+		if (!sent && !closed())
+			senders.signal.wait(lock);
+		senders.count--;
+		senders.blocked--;
+		lock.unlock();
+		if (sent) {
+			notify(receivers);
+			return true;
+		}
+	}
+}
+
+bool Channel::receive(ScriptValue* value)
+{
+	for (;;) {
+		if (tryReceive(value))
+			return true;
+		if (closed())
+			return tryReceive(value);
+		std::unique_lock<std::mutex> lock(mutex);
+		receivers.count++;
+		receivers.blocked++;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		bool received = pop(value);
+		if (!received && !closed())
+			receivers.signal.wait(lock);
+		receivers.count--;
+		receivers.blocked--;
+		lock.unlock();
+		if (received) {
+			notify(senders);
+			return true;
+		}
+	}
+}
+
+int Channel::sendOrWait(ScriptValue& value, Scheduler* scheduler, uint64_t task)
+{
+	if (trySend(value))
+		return CHANNEL_DONE;
+	std::unique_lock<std::mutex> lock(mutex);
+	if (closed())
+		return CHANNEL_CLOSED;
+	senders.count++;
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (!push(value)) {
+		Waiter waiter = {scheduler->handle(), task};
+		senders.tasks.push_back(std::move(waiter));
+		return CHANNEL_WAITING;
+	}
+	senders.count--;
+	lock.unlock();
+	notify(receivers);
+	return CHANNEL_DONE;
+}
+
+int Channel::receiveOrWait(ScriptValue* value, Scheduler* scheduler, uint64_t task)
+{
+	if (tryReceive(value))
+		return CHANNEL_DONE;
+	std::unique_lock<std::mutex> lock(mutex);
+	if (closed()) {
+		lock.unlock();
+		return tryReceive(value) ? CHANNEL_DONE : CHANNEL_CLOSED;
+	}
+	receivers.count++;
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (!pop(value)) {
+		Waiter waiter = {scheduler->handle(), task};
+		receivers.tasks.push_back(std::move(waiter));
+		return CHANNEL_WAITING;
+	}
+	receivers.count--;
+	lock.unlock();
+	notify(senders);
+	return CHANNEL_DONE;
+}
+
+void Channel::close()
+{
+	std::vector<Waiter> woken;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		isClosed.store(true, std::memory_order_release);
+		senders.signal.notify_all();
+		receivers.signal.notify_all();
+		Waiters* sides[] = {&senders, &receivers};
+		for (Waiters* side : sides) {
+			woken.insert(woken.end(), std::make_move_iterator(side->tasks.begin()),
+				std::make_move_iterator(side->tasks.end()));
+			side->count -= (int)side->tasks.size();
+			side->tasks.clear();
+		}
+	}
+	for (Waiter& waiter : woken)
+		waiter.scheduler->post(waiter.task, wakeTask, NULL);
+}
+
+size_t Channel::size() const
+{
+	size_t sent = tail.load(std::memory_order_relaxed);
+	size_t received = head.load(std::memory_order_relaxed);
+	return sent > received ? sent - received : 0;
+}
+
+Channel* namedChannel(const std::string& name, size_t capacity)
+{
+	static std::mutex mutex;
+	static std::unordered_map<std::string, Channel*> channels;
+	std::lock_guard<std::mutex> lock(mutex);
+	Channel*& channel = channels[name];
+	if (channel == NULL)
+		channel = new Channel(capacity);
+	channel->retain();
+	return channel;
+}
+
+/************* Lua bindings **************/
+
+// registry key of the channel metatable
+static char ChannelKey;
+
+// how a send or receive that cannot go on right away waits
+enum ChannelWait { WAIT_NONE, WAIT_TASK, WAIT_COROUTINE, WAIT_THREAD };
+
+// what is left to do once the C++ values of a send or receive are destroyed, since
+// raising an error or yielding skips destructors; STEP_ERROR leaves the error on the stack
+enum ChannelStep { STEP_DONE, STEP_BLOCKED, STEP_YIELD, STEP_CLOSED, STEP_UNSUPPORTED, STEP_ERROR };
+
+static ChannelWait waitFor(lua_State* lua, Scheduler** scheduler)
+{
+	if (!lua_isyieldable(lua))
+		return WAIT_THREAD;
+	*scheduler = Scheduler::of(lua);
+	return *scheduler != NULL && (*scheduler)->isTask(lua) ? WAIT_TASK : WAIT_COROUTINE;
+}
+
+static Channel* checkChannelArg(lua_State* lua, int arg)
+{
+	bool same = false;
+	if (lua_type(lua, arg) == LUA_TUSERDATA && lua_getmetatable(lua, arg)) {
+		same = lua_rawequal(lua, -1, lua_upvalueindex(1)) != 0;
+		lua_pop(lua, 1);
+	}
+	luaL_argcheck(lua, same, arg, "expected a channel");
+	Channel* channel = *(Channel**)lua_touserdata(lua, arg);
+	luaL_argcheck(lua, channel != NULL, arg, "channel was freed");
+	return channel;
+}
+
+// sends the value at index 2
+static ChannelStep sendValue(lua_State* lua, Channel* channel, ChannelWait wait, Scheduler* scheduler)
+{
+	ScriptValue value;
+	if (!toScriptValue(lua, 2, &value))
+		return STEP_UNSUPPORTED;
+	if (channel->closed())
+		return STEP_CLOSED;
+	switch (wait) {
+		case WAIT_NONE:
+			return channel->trySend(value) ? STEP_DONE : STEP_BLOCKED;
+		case WAIT_COROUTINE:
+			return channel->trySend(value) ? STEP_DONE : STEP_YIELD;
+		case WAIT_THREAD:
+			return channel->send(value) ? STEP_DONE : STEP_CLOSED;
+		case WAIT_TASK: {
+			if (scheduler == NULL)
+				break;
+			uint64_t task = scheduler->suspend(lua, true);
+			int result = channel->sendOrWait(value, scheduler, task);
+			if (result == CHANNEL_WAITING)
+				return STEP_YIELD;
+			scheduler->cancel(task);
+			return result == CHANNEL_DONE ? STEP_DONE : STEP_CLOSED;
+		}
+	}
+	return STEP_BLOCKED;
+}
+
+// Runs inside lua_pcall with the received value as a light userdata, so a memory error
+// while building a string or an array returns to receiveValue, which destroys the value
+// before raising the error.
+static int pushReceived(lua_State* lua)
+{
+	pushScriptValue(lua, *(const ScriptValue*)lua_touserdata(lua, 1));
+	return 1;
+}
+
+// pushes the value received
+static ChannelStep receiveValue(lua_State* lua, Channel* channel, ChannelWait wait, Scheduler* scheduler)
+{
+	ScriptValue value;
+	ChannelStep step = STEP_DONE;
+	switch (wait) {
+		case WAIT_NONE:
+			if (!channel->tryReceive(&value))
+				step = channel->closed() ? STEP_CLOSED : STEP_BLOCKED;
+			break;
+		case WAIT_COROUTINE:
+			if (!channel->tryReceive(&value))
+				step = channel->closed() ? STEP_CLOSED : STEP_YIELD;
+			break;
+		case WAIT_THREAD:
+			if (!channel->receive(&value))
+				step = STEP_CLOSED;
+			break;
+		case WAIT_TASK: {
+			if (scheduler == NULL) {
+				step = STEP_BLOCKED;
+				break;
+			}
+			uint64_t task = scheduler->suspend(lua, true);
+			int result = channel->receiveOrWait(&value, scheduler, task);
+			if (result == CHANNEL_WAITING)
+				return STEP_YIELD;
+			scheduler->cancel(task);
+			if (result == CHANNEL_CLOSED)
+				step = STEP_CLOSED;
+			break;
+		}
+	}
+	if (step != STEP_DONE)
+		return step;
+	switch (value.kind) {
+		case ScriptValue::STRING:
+		case ScriptValue::ARRAY:
+		case ScriptValue::SHARED_ARRAY:
+			lua_pushcfunction(lua, pushReceived);
+			lua_pushlightuserdata(lua, &value);
+			return lua_pcall(lua, 1, 1, 0) == LUA_OK ? STEP_DONE : STEP_ERROR;
+		default:
+			// pushing nil, a boolean or a number allocates nothing
+			pushScriptValue(lua, value);
+			return STEP_DONE;
+	}
+}
+
+static int channel_send(lua_State* lua);
+static int channel_recv(lua_State* lua);
+
+static int continueSend(lua_State* lua, int status, lua_KContext context)
+{
+	(void)status;
+	(void)context;
+	lua_settop(lua, 2);
+	return channel_send(lua);
+}
+
+static int continueReceive(lua_State* lua, int status, lua_KContext context)
+{
+	(void)status;
+	(void)context;
+	lua_settop(lua, 1);
+	return channel_recv(lua);
+}
+
+// Waits for room: a Scheduler task is suspended, another coroutine yields to whoever
+// resumed it and tries again when resumed, and anything else blocks the thread.
+static int channel_send(lua_State* lua)
+{
+	Channel* channel = checkChannelArg(lua, 1);
+	luaL_checkany(lua, 2);
+	lua_settop(lua, 2);
+	Scheduler* scheduler = NULL;
+	ChannelWait wait = waitFor(lua, &scheduler);
+	switch (sendValue(lua, channel, wait, scheduler)) {
+		case STEP_UNSUPPORTED:
+			return luaL_argerror(lua, 2, lua_pushfstring(lua, "cannot send a %s through a channel", luaL_typename(lua, 2)));
+		case STEP_CLOSED:
+			return luaL_error(lua, "send on a closed channel");
+		case STEP_YIELD:
+			return lua_yieldk(lua, 0, 0, continueSend);
+		default:
+			return 0;
+	}
+}
+
+// returns false instead of waiting
+static int channel_trysend(lua_State* lua)
+{
+	Channel* channel = checkChannelArg(lua, 1);
+	luaL_checkany(lua, 2);
+	lua_settop(lua, 2);
+	switch (sendValue(lua, channel, WAIT_NONE, NULL)) {
+		case STEP_UNSUPPORTED:
+			return luaL_argerror(lua, 2, lua_pushfstring(lua, "cannot send a %s through a channel", luaL_typename(lua, 2)));
+		case STEP_CLOSED:
+			return luaL_error(lua, "send on a closed channel");
+		case STEP_DONE:
+			lua_pushboolean(lua, 1);
+			return 1;
+		default:
+			lua_pushboolean(lua, 0);
+			return 1;
+	}
+}
+
+// returns the value and true, or nil and false once the channel is closed and empty;
+// waits like send
+static int channel_recv(lua_State* lua)
+{
+	Channel* channel = checkChannelArg(lua, 1);
+	lua_settop(lua, 1);
+	Scheduler* scheduler = NULL;
+	ChannelWait wait = waitFor(lua, &scheduler);
+	switch (receiveValue(lua, channel, wait, scheduler)) {
+		case STEP_DONE:
+			lua_pushboolean(lua, 1);
+			return 2;
+		case STEP_YIELD:
+			return lua_yieldk(lua, 0, 0, continueReceive);
+		case STEP_ERROR:
+			return lua_error(lua);
+		default:
+			lua_pushnil(lua);
+			lua_pushboolean(lua, 0);
+			return 2;
+	}
+}
+
+// returns nil and false instead of waiting
+static int channel_tryrecv(lua_State* lua)
+{
+	Channel* channel = checkChannelArg(lua, 1);
+	lua_settop(lua, 1);
+	ChannelStep step = receiveValue(lua, channel, WAIT_NONE, NULL);
+	if (step == STEP_ERROR)
+		return lua_error(lua);
+	if (step == STEP_DONE) {
+		lua_pushboolean(lua, 1);
+		return 2;
+	}
+	lua_pushnil(lua);
+	lua_pushboolean(lua, 0);
+	return 2;
+}
+
+static int channel_close(lua_State* lua)
+{
+	checkChannelArg(lua, 1)->close();
+	return 0;
+}
+
+static int channel_size(lua_State* lua)
+{
+	lua_pushinteger(lua, (lua_Integer)checkChannelArg(lua, 1)->size());
+	return 1;
+}
+
+static int channel_capacity(lua_State* lua)
+{
+	lua_pushinteger(lua, (lua_Integer)checkChannelArg(lua, 1)->capacity());
+	return 1;
+}
+
+// __gc; can be called by hand, so the box is emptied and an empty box is skipped
+static int channel_free(lua_State* lua)
+{
+	Channel** box = (Channel**)lua_touserdata(lua, 1);
+	if (*box != NULL) {
+		(*box)->release();
+		*box = NULL;
+	}
+	return 0;
+}
+
+// pushes the channel metatable, creating it the first time
+static void pushChannelMetatable(lua_State* lua)
+{
+	if (lua_rawgetp(lua, LUA_REGISTRYINDEX, &ChannelKey) != LUA_TNIL)
+		return;
+	lua_pop(lua, 1);
+
+	const luaL_Reg methods[] = {
+		{"send", channel_send},
+		{"trysend", channel_trysend},
+		{"recv", channel_recv},
+		{"tryrecv", channel_tryrecv},
+		{"close", channel_close},
+		{"size", channel_size},
+		{"capacity", channel_capacity},
+		{NULL, NULL}
+	};
+	lua_newtable(lua);
+	int metatable = lua_gettop(lua);
+	lua_pushcfunction(lua, channel_free);
+	lua_setfield(lua, metatable, "__gc");
+		lua_newtable(lua);
+		lua_pushvalue(lua, metatable);
+		luaL_setfuncs(lua, methods, 1);
+	lua_setfield(lua, metatable, "__index");
+	lua_pushvalue(lua, metatable);
+	lua_rawsetp(lua, LUA_REGISTRYINDEX, &ChannelKey);
+}
+
+void pushChannel(lua_State* lua, Channel* channel)
+{
+	Channel** box = (Channel**)lua_newuserdata(lua, sizeof(Channel*));
+	*box = NULL;
+	pushChannelMetatable(lua);
+	lua_setmetatable(lua, -2);
+	channel->retain();
+	*box = channel;
+}
+
+Channel* toChannel(lua_State* lua, int index)
+{
+	if (lua_type(lua, index) != LUA_TUSERDATA || !lua_getmetatable(lua, index))
+		return NULL;
+	lua_rawgetp(lua, LUA_REGISTRYINDEX, &ChannelKey);
+	bool same = lua_rawequal(lua, -1, -2) != 0;
+	lua_pop(lua, 2);
+	// NULL too for a channel whose __gc was already called
+	return same ? *(Channel**)lua_touserdata(lua, index) : NULL;
+}
+
+static lua_Integer checkCapacity(lua_State* lua, int arg)
+{
+	lua_Integer capacity = luaL_optinteger(lua, arg, 64);
+	luaL_argcheck(lua, capacity > 0 && capacity <= (1 << 24), arg, "capacity out of range");
+	return capacity;
+}
+
+// channel.new([capacity])
+static int channel_new(lua_State* lua)
+{
+	Channel* channel = new Channel((size_t)checkCapacity(lua, 1));
+	pushChannel(lua, channel);
+	channel->release();
+	return 1;
+}
+
+// channel.named(name [, capacity]) is the same channel in every state of the process
+static int channel_named(lua_State* lua)
+{
+	const char* name = luaL_checkstring(lua, 1);
+	Channel* channel = namedChannel(name, (size_t)checkCapacity(lua, 2));
+	pushChannel(lua, channel);
+	channel->release();
+	return 1;
+}
+
+void openChannel(lua_State* lua)
+{
+	const luaL_Reg functions[] = {
+		{"new", channel_new},
+		{"named", channel_named},
+		{NULL, NULL}
+	};
+	pushChannelMetatable(lua);
+	lua_pop(lua, 1);
+	luaL_newlib(lua, functions);
+	lua_setglobal(lua, "channel");
+}
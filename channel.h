@@ -0,0 +1,113 @@
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include "executor.h"
+#include "scheduler.h"
+#include <stdint.h>
+#include <string>
+#include <deque>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+
+enum { CHANNEL_DONE, CHANNEL_WAITING, CHANNEL_CLOSED };
+
+// A bounded multi-producer multi-consumer queue of ScriptValues that any number of states
+// on any threads may hold: numbers, booleans, nil, strings and arrays, where shared arrays
+// pass a reference to their SharedBuffer instead of a copy. The ring is lock-free (one
+// compare-and-swap per send or receive); the mutex is only taken to put a waiter to sleep
+// or wake one, and only when a waiter exists. A channel starts with one reference.
+class Channel {
+public:
+	// the capacity is rounded up to a power of two, at least 2
+	explicit Channel(size_t capacity);
+
+	void retain();
+	void release();
+
+	// move the value in or out without waiting; false when full, or empty
+	bool trySend(ScriptValue& value);
+	bool tryReceive(ScriptValue* value);
+
+	// block the calling thread until there is room or a value; false once the channel is
+	// closed (and, for receive, empty)
+	bool send(ScriptValue& value);
+	bool receive(ScriptValue* value);
+
+	// Like trySend and tryReceive, but when they fail the task is queued to be woken
+	// through scheduler->post once the channel may have room or a value; the task must
+	// already be suspended with byPost. Returns CHANNEL_DONE, CHANNEL_WAITING when the
+	// task was queued, or CHANNEL_CLOSED when it was not. A wake does not promise
+	// success: try again.
+	int sendOrWait(ScriptValue& value, Scheduler* scheduler, uint64_t task);
+	int receiveOrWait(ScriptValue* value, Scheduler* scheduler, uint64_t task);
+
+	// wakes every waiter; later sends fail, receives drain what is left
+	void close();
+	bool closed() const { return isClosed.load(std::memory_order_acquire); }
+
+	size_t capacity() const { return mask + 1; }
+
+	// values in the ring; only a hint while other threads use the channel
+	size_t size() const;
+
+private:
+	struct Cell {
+		std::atomic<size_t> sequence;
+		ScriptValue value;
+	};
+
+	// the handle, not the Scheduler, so a waiter left behind by a destroyed scheduler is
+	// skipped instead of posted to
+	struct Waiter {
+		std::shared_ptr<SchedulerHandle> scheduler;
+		uint64_t task;
+	};
+
+	// a side of the channel: threads and tasks waiting to send, or to receive
+	struct Waiters {
+		std::atomic<int> count;      // blocked threads and queued tasks
+		int blocked;                 // threads in wait(); under mutex
+		std::condition_variable signal;
+		std::deque<Waiter> tasks;
+	};
+
+	// the counters senders and receivers write sit on cache lines of their own
+	Cell* cells;
+	size_t mask;
+	char padding0[64];
+	std::atomic<size_t> tail;   // next cell to send to
+	char padding1[64 - sizeof(std::atomic<size_t>)];
+	std::atomic<size_t> head;   // next cell to receive from
+	char padding2[64 - sizeof(std::atomic<size_t>)];
+	std::atomic<int> refs;
+	std::atomic<bool> isClosed;
+	std::mutex mutex;
+	Waiters senders;
+	Waiters receivers;
+
+	~Channel();
+	bool push(ScriptValue& value);
+	bool pop(ScriptValue* value);
+	void notify(Waiters& side);
+	void notifyAll(Waiters& side);
+
+	Channel(const Channel&) = delete;
+	Channel& operator=(const Channel&) = delete;
+};
+
+// The channel of the process with that name, created with the capacity if there is none;
+// returns a new reference. Named channels live until the process exits.
+Channel* namedChannel(const std::string& name, size_t capacity);
+
+// pushes a userdata holding its own reference to the channel
+void pushChannel(lua_State* lua, Channel* channel);
+
+// the channel at the index, or NULL
+Channel* toChannel(lua_State* lua, int index);
+
+// sets the global channel table: channel.new(capacity) and channel.named(name, capacity)
+void openChannel(lua_State* lua);
+
+#endif
@@ -0,0 +1,196 @@
+#include "chunk_cache.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+// FNV-1a
+static uint64_t hashBytes(const char* bytes, size_t size)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= (unsigned char)bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+// nanoseconds where the platform keeps them, so two edits in the same second differ
+static int64_t fileTime(const struct stat* st)
+{
+#if defined(__linux__)
+	return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#else
+	return (int64_t)st->st_mtime * 1000000000;
+#endif
+}
+
+static bool readFile(const char* path, std::string* bytes)
+{
+	FILE* file = fopen(path, "rb");
+	if (file == NULL)
+		return false;
+	char buffer[8192];
+	size_t n;
+	bytes->clear();
+	while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+		bytes->append(buffer, n);
+	bool ok = !ferror(file);
+	fclose(file);
+	return ok;
+}
+
+static int writeBytecode(lua_State* lua, const void* p, size_t size, void* ud)
+{
+	(void)lua;
+	((std::string*)ud)->append((const char*)p, size);
+	return 0;
+}
+
+ChunkCache::ChunkCache(const char* directory)
+	: directory(directory ? directory : ""), stats()
+{
+}
+
+std::string ChunkCache::diskPath(const std::string& path, uint64_t hash) const
+{
+	char name[64];
+	snprintf(name, sizeof(name), "/%016llx-%016llx.luac",
+		(unsigned long long)hashBytes(path.data(), path.size()), (unsigned long long)hash);
+	return directory + name;
+}
+
+// copies the bytecode of an entry whose file has not changed since it was cached
+bool ChunkCache::cached(const std::string& path, int64_t mtime, int64_t size, std::string* bytecode)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	auto entry = entries.find(path);
+	if (entry == entries.end() || entry->second.mtime != mtime || entry->second.size != size)
+		return false;
+	stats.hits++;
+	*bytecode = entry->second.bytecode;
+	return true;
+}
+
+void ChunkCache::store(const std::string& path, const Entry& entry)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	Entry& old = entries[path];
+	stats.bytes = stats.bytes - old.bytecode.size() + entry.bytecode.size();
+	old = entry;
+}
+
+int ChunkCache::loadFile(lua_State* lua, const char* path)
+{
+	std::string key = path;
+	std::string chunkname = "@" + key;
+
+	struct stat st;
+	if (stat(path, &st) != 0) {
+		lua_pushfstring(lua, "cannot open %s: %s", path, strerror(errno));
+		return LUA_ERRFILE;
+	}
+	Entry entry;
+	entry.mtime = fileTime(&st);
+	entry.size = (int64_t)st.st_size;
+
+	// unchanged since last time: no read, no hash, no parse
+	if (cached(key, entry.mtime, entry.size, &entry.bytecode)) {
+		if (luaL_loadbufferx(lua, entry.bytecode.data(), entry.bytecode.size(), chunkname.c_str(), "b") == LUA_OK)
+			return LUA_OK;
+		lua_pop(lua, 1);
+	}
+
+	std::string source;
+	if (!readFile(path, &source)) {
+		lua_pushfstring(lua, "cannot read %s: %s", path, strerror(errno));
+		return LUA_ERRFILE;
+	}
+	entry.hash = hashBytes(source.data(), source.size());
+
+	// touched but not changed
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto old = entries.find(key);
+		if (old != entries.end() && old->second.hash == entry.hash) {
+			old->second.mtime = entry.mtime;
+			old->second.size = entry.size;
+			entry.bytecode = old->second.bytecode;
+			stats.rehashes++;
+		}
+		else {
+			entry.bytecode.clear();
+		}
+	}
+	if (!entry.bytecode.empty()) {
+		if (luaL_loadbufferx(lua, entry.bytecode.data(), entry.bytecode.size(), chunkname.c_str(), "b") == LUA_OK)
+			return LUA_OK;
+		lua_pop(lua, 1);
+	}
+
+	// compiled by an earlier run; a dump from another Lua build fails to load and is replaced
+	std::string disk = directory.empty() ? "" : diskPath(key, entry.hash);
+	if (!disk.empty() && readFile(disk.c_str(), &entry.bytecode)) {
+		if (luaL_loadbufferx(lua, entry.bytecode.data(), entry.bytecode.size(), chunkname.c_str(), "b") == LUA_OK) {
+			store(key, entry);
+			std::lock_guard<std::mutex> lock(mutex);
+			stats.diskHits++;
+			return LUA_OK;
+		}
+		lua_pop(lua, 1);
+	}
+
+	// like luaL_loadfile, skip a first line starting with # but keep its newline
+	size_t start = 0;
+	if (!source.empty() && source[0] == '#') {
+		start = source.find('\n');
+		if (start == std::string::npos)
+			start = source.size();
+	}
+	int status = luaL_loadbuffer(lua, source.data() + start, source.size() - start, chunkname.c_str());
+	if (status != LUA_OK)
+		return status;
+
+	entry.bytecode.clear();
+	lua_dump(lua, writeBytecode, &entry.bytecode, 0);
+	store(key, entry);
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stats.compiles++;
+	}
+
+	if (!disk.empty()) {
+		// write then rename, so a reader never sees half a file
+		std::string temporary = disk + ".tmp";
+		FILE* file = fopen(temporary.c_str(), "wb");
+		if (file != NULL) {
+			bool ok = fwrite(entry.bytecode.data(), 1, entry.bytecode.size(), file) == entry.bytecode.size();
+			ok = fclose(file) == 0 && ok;
+			remove(disk.c_str());
+			if (!ok || rename(temporary.c_str(), disk.c_str()) != 0)
+				remove(temporary.c_str());
+		}
+	}
+	return LUA_OK;
+}
+
+int ChunkCache::doFile(lua_State* lua, const char* path)
+{
+	int status = loadFile(lua, path);
+	if (status != LUA_OK)
+		return status;
+	return lua_pcall(lua, 0, LUA_MULTRET, 0);
+}
+
+void ChunkCache::clear()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	entries.clear();
+	stats.bytes = 0;
+}
+
+ChunkCacheStats ChunkCache::statistics() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return stats;
+}
@@ -0,0 +1,60 @@
+#ifndef CHUNK_CACHE_H
+#define CHUNK_CACHE_H
+
+#include <lua.hpp>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <mutex>
+
+typedef struct {
+	uint64_t hits;      // loads served from memory without reading the file
+	uint64_t rehashes;  // the file changed its mtime but not its content
+	uint64_t diskHits;  // bytecode found in the cache directory
+	uint64_t compiles;  // sources parsed and compiled
+	size_t bytes;       // bytecode held in memory
+} ChunkCacheStats;
+
+// Keeps the lua_dump bytecode of script files so that loading one again skips parsing
+// and compiling. An entry is keyed by path; it is reused as is while the file keeps its
+// mtime and size, and after they change only if the content hash still matches. With a
+// directory, bytecode is also written to <directory>/<path hash>-<content hash>.luac and
+// survives restarts. Safe to share between threads and states.
+class ChunkCache {
+public:
+	// directory may be NULL to cache in memory only; it must exist
+	explicit ChunkCache(const char* directory = NULL);
+
+	// like luaL_loadfile: pushes the chunk, or an error message and returns an error code
+	int loadFile(lua_State* lua, const char* path);
+
+	// like luaL_dofile
+	int doFile(lua_State* lua, const char* path);
+
+	// forgets the bytecode kept in memory
+	void clear();
+
+	ChunkCacheStats statistics() const;
+
+private:
+	struct Entry {
+		int64_t mtime;
+		int64_t size;
+		uint64_t hash;
+		std::string bytecode;
+	};
+
+	std::string directory;
+	std::unordered_map<std::string, Entry> entries;
+	mutable std::mutex mutex;
+	ChunkCacheStats stats;
+
+	bool cached(const std::string& path, int64_t mtime, int64_t size, std::string* bytecode);
+	void store(const std::string& path, const Entry& entry);
+	std::string diskPath(const std::string& path, uint64_t hash) const;
+
+	ChunkCache(const ChunkCache&) = delete;
+	ChunkCache& operator=(const ChunkCache&) = delete;
+};
+
+#endif
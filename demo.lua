@@ -27,9 +27,27 @@ function useVector()
     local vec1 = Vector(12, 14)
     local vec2 = Vector(8, 11)
 
-    -- print(vec1.x, vec1.y)
-    -- print(vec2.x, vec2.y)
-    -- print(vec1:distance(vec2))
+    print(vec1.x, vec1.y)
+    print(vec2.x, vec2.y)
+    print(vec1:distance(vec2), vec1:distance({x = 0, y = 0}))
+    print(vec1 + vec2, vec1 - vec2, 2 * vec1, -vec2)
+    print(vec1:dot(vec2), vec1:length(), vec1:normalize())
+
+    local points = VectorArray(2)
+    points:add(vec1)
+    points:add(vec2)
+    points:add(3, 4)
+    points:add(-5, 1)
+
+    local distances = points:distances(Vector(0, 0))
+    for i = 1, #points do
+        print(points[i], distances[i])
+    end
+    print(table.unpack(points:nearest(Vector(9, 9), 2)))
+    print(points:bounds())
+    print(points:centroid())
+    points:translate(Vector(1, 1))
+    print(points[1])
 end
 
 function useArray()
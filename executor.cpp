@@ -0,0 +1,307 @@
+#include "executor.h"
+#include <string.h>
+
+/************* Marshalling values between states **************/
+
+ScriptValue::ScriptValue(const ScriptValue& other)
+	: kind(other.kind), boolean(other.boolean), integer(other.integer), number(other.number),
+	  bytes(other.bytes), arrayType(other.arrayType), arraySize(other.arraySize),
+	  strings(other.strings), shared(other.shared)
+{
+	if (shared)
+		retainSharedBuffer(shared);
+}
+
+ScriptValue& ScriptValue::operator=(const ScriptValue& other)
+{
+	if (other.shared)
+		retainSharedBuffer(other.shared);
+	if (shared)
+		releaseSharedBuffer(shared);
+	kind = other.kind;
+	boolean = other.boolean;
+	integer = other.integer;
+	number = other.number;
+	bytes = other.bytes;
+	arrayType = other.arrayType;
+	arraySize = other.arraySize;
+	strings = other.strings;
+	shared = other.shared;
+	return *this;
+}
+
+// takes over the other value's strings and buffer reference
+ScriptValue::ScriptValue(ScriptValue&& other)
+	: kind(other.kind), boolean(other.boolean), integer(other.integer), number(other.number),
+	  bytes(std::move(other.bytes)), arrayType(other.arrayType), arraySize(other.arraySize),
+	  strings(std::move(other.strings)), shared(other.shared)
+{
+	other.shared = NULL;
+}
+
+ScriptValue& ScriptValue::operator=(ScriptValue&& other)
+{
+	if (this == &other)
+		return *this;
+	if (shared)
+		releaseSharedBuffer(shared);
+	kind = other.kind;
+	boolean = other.boolean;
+	integer = other.integer;
+	number = other.number;
+	bytes = std::move(other.bytes);
+	arrayType = other.arrayType;
+	arraySize = other.arraySize;
+	strings = std::move(other.strings);
+	shared = other.shared;
+	other.shared = NULL;
+	return *this;
+}
+
+ScriptValue::~ScriptValue()
+{
+	if (shared)
+		releaseSharedBuffer(shared);
+}
+
+bool toScriptValue(lua_State* lua, int index, ScriptValue* value)
+{
+	*value = ScriptValue();
+	switch (lua_type(lua, index)) {
+		case LUA_TNIL:
+			return true;
+		case LUA_TBOOLEAN:
+			*value = ScriptValue(lua_toboolean(lua, index) != 0);
+			return true;
+		case LUA_TNUMBER:
+			if (lua_isinteger(lua, index))
+				*value = ScriptValue(lua_tointeger(lua, index));
+			else
+				*value = ScriptValue(lua_tonumber(lua, index));
+			return true;
+		case LUA_TSTRING: {
+			size_t length;
+			const char* s = lua_tolstring(lua, index, &length);
+			value->kind = ScriptValue::STRING;
+			value->bytes.assign(s, length);
+			return true;
+		}
+		case LUA_TUSERDATA: {
+			Array* arr = toArray(lua, index);
+			if (arr == NULL)
+				return false;
+			if (arr->storage == ARRAY_SHARED) {
+				// no Lua call, so shareArray cannot raise an error here
+				*value = ScriptValue(shareArray(lua, arr));
+				return true;
+			}
+			value->kind = ScriptValue::ARRAY;
+			value->arrayType = arr->type;
+			value->arraySize = arr->size;
+			if (arr->type == ARRAY_STRING) {
+				ArrayString* strings = elements<ArrayString>(arr);
+				value->strings.reserve(arr->size);
+				for (size_t i = 0; i < arr->size; i++)
+					value->strings.emplace_back(arr->strings.bytes + strings[i].offset, strings[i].length);
+			}
+			else {
+				value->bytes.assign((const char*)arr->data, arr->size * ArrayElementSizes[arr->type]);
+			}
+			return true;
+		}
+		default:
+			return false;
+	}
+}
+
+void pushScriptValue(lua_State* lua, const ScriptValue& value)
+{
+	switch (value.kind) {
+		case ScriptValue::NIL: lua_pushnil(lua); break;
+		case ScriptValue::BOOLEAN: lua_pushboolean(lua, value.boolean); break;
+		case ScriptValue::INTEGER: lua_pushinteger(lua, value.integer); break;
+		case ScriptValue::NUMBER: lua_pushnumber(lua, value.number); break;
+		case ScriptValue::STRING: lua_pushlstring(lua, value.bytes.data(), value.bytes.size()); break;
+		case ScriptValue::ARRAY: {
+			Array* arr = createArray(lua, value.arraySize, value.arrayType);
+			if (value.arrayType == ARRAY_STRING) {
+				for (size_t i = 0; i < value.arraySize; i++) {
+					const std::string& s = value.strings[i];
+					ArrayString element = {internString(lua, arr, s.data(), s.size()), s.size()};
+					elements<ArrayString>(arr)[i] = element;
+				}
+			}
+			else if (value.arraySize > 0) {
+				memcpy(arr->data, value.bytes.data(), value.bytes.size());
+			}
+			break;
+		}
+		case ScriptValue::SHARED_ARRAY:
+			pushSharedArray(lua, value.shared);
+			break;
+	}
+}
+
+/************* Executor **************/
+
+// Runs inside lua_pcall with the job as a light userdata. It owns no C++ objects, so a
+// Lua error unwinding through it skips no destructors.
+template <typename Job>
+static int executeJob(lua_State* lua)
+{
+	Job* job = (Job*)lua_touserdata(lua, 1);
+	lua_settop(lua, 0);
+	if (job->isCall) {
+		lua_getglobal(lua, job->code.c_str());
+	}
+	else if (luaL_loadbuffer(lua, job->code.data(), job->code.size(), "=executor")) {
+		return lua_error(lua);
+	}
+	for (size_t i = 0; i < job->args.size(); i++)
+		pushScriptValue(lua, job->args[i]);
+	lua_call(lua, (int)job->args.size(), LUA_MULTRET);
+	return lua_gettop(lua);
+}
+
+static size_t workerCount(size_t workers)
+{
+	if (workers == 0)
+		workers = std::thread::hardware_concurrency();
+	return workers == 0 ? 1 : workers;
+}
+
+Executor::Executor(size_t workers, StateSetup setup, size_t memoryLimit, bool isolateJobs)
+	: pool(workerCount(workers), setup, memoryLimit), isolateJobs(isolateJobs), next(0), jobs(0), steals(0), pending(0), stopping(false)
+{
+	for (size_t i = 0; i < pool.size(); i++)
+		this->workers.emplace_back(new Worker());
+	for (size_t i = 0; i < pool.size(); i++)
+		this->workers[i]->thread = std::thread(&Executor::work, this, i);
+}
+
+Executor::~Executor()
+{
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+		stopping = true;
+	}
+	idle.notify_all();
+	for (auto& worker : workers)
+		worker->thread.join();
+}
+
+std::future<ScriptResult> Executor::run(const std::string& chunk, std::vector<ScriptValue> args)
+{
+	return submit(false, chunk, std::move(args));
+}
+
+std::future<ScriptResult> Executor::call(const std::string& function, std::vector<ScriptValue> args)
+{
+	return submit(true, function, std::move(args));
+}
+
+std::future<ScriptResult> Executor::submit(bool isCall, const std::string& code, std::vector<ScriptValue> args)
+{
+	Job* job = new Job();
+	job->isCall = isCall;
+	job->code = code;
+	job->args = std::move(args);
+	std::future<ScriptResult> result = job->result.get_future();
+
+	Worker& worker = *workers[next++ % workers.size()];
+	{
+		std::lock_guard<std::mutex> lock(worker.mutex);
+		worker.jobs.push_back(job);
+	}
+	pending++;
+	// taking the lock orders the increment before any worker's check of pending
+	{
+		std::lock_guard<std::mutex> lock(sleepMutex);
+	}
+	idle.notify_one();
+	return result;
+}
+
+// the newest job of the worker's own deque, else the oldest job of another deque
+Executor::Job* Executor::take(size_t self)
+{
+	Job* job = NULL;
+	{
+		Worker& own = *workers[self];
+		std::lock_guard<std::mutex> lock(own.mutex);
+		if (!own.jobs.empty()) {
+			job = own.jobs.back();
+			own.jobs.pop_back();
+		}
+	}
+	for (size_t i = 1; job == NULL && i < workers.size(); i++) {
+		Worker& victim = *workers[(self + i) % workers.size()];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+		if (!victim.jobs.empty()) {
+			job = victim.jobs.front();
+			victim.jobs.pop_front();
+			steals++;
+		}
+	}
+	if (job != NULL)
+		pending--;
+	return job;
+}
+
+void Executor::work(size_t self)
+{
+	// the pool holds one state per worker, so this never waits
+	StatePool::Lease lua(pool);
+	for (;;) {
+		Job* job = take(self);
+		if (job != NULL) {
+			bool ok = execute(lua, job);
+			delete job;
+			if (!ok || isolateJobs)
+				pool.reset(lua);
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(sleepMutex);
+		idle.wait(lock, [this] { return stopping || pending > 0; });
+		if (stopping && pending == 0)
+			return;
+	}
+}
+
+// returns whether the job succeeded; the worker's stack is left empty either way
+bool Executor::execute(lua_State* lua, Job* job)
+{
+	ScriptResult result;
+	result.ok = true;
+	{
+		lua_pushcfunction(lua, executeJob<Job>);
+		lua_pushlightuserdata(lua, job);
+		if (lua_pcall(lua, 1, LUA_MULTRET, 0)) {
+			const char* message = lua_tostring(lua, -1);
+			result.ok = false;
+			result.error = message ? message : "error object is not a string";
+		}
+		else {
+			int count = lua_gettop(lua);
+			result.values.resize(count);
+			for (int i = 0; i < count && result.ok; i++) {
+				if (!toScriptValue(lua, i + 1, &result.values[i])) {
+					result.ok = false;
+					result.error = std::string("cannot return a ") + luaL_typename(lua, i + 1) + " from a job";
+					result.values.clear();
+				}
+			}
+		}
+		lua_settop(lua, 0);
+	}
+	jobs++;
+	bool ok = result.ok;
+	job->result.set_value(std::move(result));
+	return ok;
+}
+
+ExecutorMetrics Executor::metrics() const
+{
+	ExecutorMetrics m = {jobs.load(), steals.load()};
+	return m;
+}
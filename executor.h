@@ -0,0 +1,128 @@
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+#include "array.h"
+#include "state_pool.h"
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <future>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+
+// A Lua value copied out of one state so it can be pushed into another: nil, a boolean,
+// a number, a string or an Array. Arrays are copied element by element, except shared
+// arrays, which pass a reference to their SharedBuffer.
+struct ScriptValue {
+	enum Kind { NIL, BOOLEAN, INTEGER, NUMBER, STRING, ARRAY, SHARED_ARRAY };
+
+	Kind kind;
+	bool boolean;
+	lua_Integer integer;
+	lua_Number number;
+	std::string bytes;                // STRING, or the elements of a numeric ARRAY
+	ArrayType arrayType;              // ARRAY
+	size_t arraySize;                 // ARRAY
+	std::vector<std::string> strings; // elements of a string ARRAY
+	SharedBuffer* shared;             // SHARED_ARRAY; one reference owned by this value
+
+	ScriptValue() : kind(NIL), boolean(false), integer(0), number(0), arrayType(ARRAY_NUMBER), arraySize(0), shared(NULL) {}
+	ScriptValue(bool b) : ScriptValue() { kind = BOOLEAN; boolean = b; }
+	ScriptValue(int i) : ScriptValue() { kind = INTEGER; integer = i; }
+	ScriptValue(lua_Integer i) : ScriptValue() { kind = INTEGER; integer = i; }
+	ScriptValue(lua_Number n) : ScriptValue() { kind = NUMBER; number = n; }
+	ScriptValue(const char* s) : ScriptValue() { kind = STRING; bytes = s; }
+	ScriptValue(const std::string& s) : ScriptValue() { kind = STRING; bytes = s; }
+	// takes over a reference, e.g. one returned by shareArray
+	explicit ScriptValue(SharedBuffer* buffer) : ScriptValue() { kind = SHARED_ARRAY; shared = buffer; }
+
+	ScriptValue(const ScriptValue& other);
+	ScriptValue& operator=(const ScriptValue& other);
+	ScriptValue(ScriptValue&& other);
+	ScriptValue& operator=(ScriptValue&& other);
+	~ScriptValue();
+};
+
+// copies the value at the given index; returns false for values that cannot cross states
+bool toScriptValue(lua_State* lua, int index, ScriptValue* value);
+
+// pushes a copy of the value; may raise a Lua error if memory runs out
+void pushScriptValue(lua_State* lua, const ScriptValue& value);
+
+typedef struct {
+	bool ok;
+	std::string error;
+	std::vector<ScriptValue> values; // everything the chunk or function returned
+} ScriptResult;
+
+typedef struct {
+	uint64_t jobs;   // jobs run to completion
+	uint64_t steals; // jobs a worker took from another worker's deque
+} ExecutorMetrics;
+
+// Runs chunks and global function calls on a fixed set of worker threads, one lua_State
+// per worker. Submitted jobs are spread round-robin over per-worker deques; a worker
+// takes its newest job first and, when its deque is empty, steals the oldest job from
+// another worker. Each worker leases its state from a StatePool once and keeps it warm:
+// globals a job sets are seen by later jobs on the same worker. The state is reset to
+// its setup globals after a failed job, or after every job with isolateJobs, which costs
+// a pass over the globals and loaded modules per job.
+class Executor {
+public:
+	// workers = 0 uses one worker per hardware thread; memoryLimit caps each state's bytes
+	Executor(size_t workers, StateSetup setup, size_t memoryLimit = 0, bool isolateJobs = false);
+
+	// finishes every submitted job, then stops the workers
+	~Executor();
+
+	// runs a chunk with the arguments as its varargs
+	std::future<ScriptResult> run(const std::string& chunk, std::vector<ScriptValue> args = {});
+
+	// calls a global function, e.g. one defined by a script the setup callback loaded
+	std::future<ScriptResult> call(const std::string& function, std::vector<ScriptValue> args = {});
+
+	ExecutorMetrics metrics() const;
+
+	size_t size() const { return workers.size(); }
+
+private:
+	struct Job {
+		bool isCall;
+		std::string code; // chunk source or function name
+		std::vector<ScriptValue> args;
+		std::promise<ScriptResult> result;
+	};
+
+	struct Worker {
+		std::mutex mutex;
+		std::deque<Job*> jobs;
+		std::thread thread;
+	};
+
+	StatePool pool;
+	bool isolateJobs;
+	std::vector<std::unique_ptr<Worker>> workers;
+	std::atomic<size_t> next;
+	std::atomic<uint64_t> jobs;
+	std::atomic<uint64_t> steals;
+
+	// workers sleep on idle while no job is queued anywhere
+	std::atomic<size_t> pending;
+	std::mutex sleepMutex;
+	std::condition_variable idle;
+	bool stopping;
+
+	std::future<ScriptResult> submit(bool isCall, const std::string& code, std::vector<ScriptValue> args);
+	Job* take(size_t self);
+	void work(size_t self);
+	bool execute(lua_State* lua, Job* job);
+
+	Executor(const Executor&) = delete;
+	Executor& operator=(const Executor&) = delete;
+};
+
+#endif
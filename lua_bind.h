@@ -0,0 +1,98 @@
+#ifndef LUA_BIND_H
+#define LUA_BIND_H
+
+#include "lua_function.h"
+#include <exception>
+#include <stdio.h>
+
+// calls a bound function and pushes what it returned; returns how many values that is
+template <typename R>
+struct LuaReturn {
+	template <typename F, typename... A>
+	static int call(lua_State* lua, F f, const A&... args)
+	{
+		LuaTypeOf<R>::push(lua, f(args...));
+		return 1;
+	}
+};
+
+template <>
+struct LuaReturn<void> {
+	template <typename F, typename... A>
+	static int call(lua_State*, F f, const A&... args)
+	{
+		f(args...);
+		return 0;
+	}
+};
+
+template <typename... T>
+struct LuaReturn<std::tuple<T...> > {
+	template <typename F, typename... A>
+	static int call(lua_State* lua, F f, const A&... args)
+	{
+		return push(lua, f(args...), typename MakeLuaIndices<sizeof...(T)>::type());
+	}
+	template <size_t... I>
+	static int push(lua_State* lua, const std::tuple<T...>& results, LuaIndices<I...>)
+	{
+		int pushed[] = {0, (LuaTypeOf<T>::push(lua, std::get<I>(results)), 0)...};
+		(void)pushed;
+		return (int)sizeof...(T);
+	}
+};
+
+template <typename F, F f>
+struct LuaBinding;
+
+// The lua_CFunction generated for a plain function. The argument count and types are
+// checked with luaL_check* calls fixed at compile time; nothing is allocated and there
+// is no indirection other than the direct call to f. A C++ exception thrown by f becomes
+// a Lua error.
+template <typename R, typename... Args, R (*f)(Args...)>
+struct LuaBinding<R (*)(Args...), f> {
+	static int call(lua_State* lua)
+	{
+		luaL_argcheck(lua, lua_gettop(lua) <= (int)sizeof...(Args), (int)sizeof...(Args) + 1, "too many arguments");
+		return invoke(lua, typename MakeLuaIndices<sizeof...(Args)>::type());
+	}
+
+	template <size_t... I>
+	static int invoke(lua_State* lua, LuaIndices<I...>)
+	{
+		// braced initialization checks the arguments left to right
+		std::tuple<typename LuaTypeOf<Args>::Arg...> args{LuaTypeOf<Args>::check(lua, (int)I + 1)...};
+		(void)args;
+		char message[256];
+		try {
+			return LuaReturn<R>::call(lua, f, std::get<I>(args)...);
+		}
+		catch (const std::exception& e) {
+			// any Lua call in the handler may raise and skip the exception's cleanup, so the
+			// message is copied out and the error raised once the handler is done
+			snprintf(message, sizeof(message), "%s", e.what());
+		}
+		return luaL_error(lua, "%s", message);
+	}
+};
+
+// bindFunction<decltype(&add), &add>() for compilers without C++17
+template <typename F, F f>
+lua_CFunction bindFunction()
+{
+	return LuaBinding<F, f>::call;
+}
+
+// the same without the comma, for use inside other macros such as lua_register
+#define LUA_BIND(f) bindFunction<decltype(&f), &f>()
+
+#if __cplusplus >= 201703L
+// bind<&add>() turns double add(double, double) into a lua_CFunction
+template <auto f>
+lua_CFunction bind()
+{
+	return LuaBinding<decltype(f), f>::call;
+}
+#endif
+
+#endif
@@ -4,6 +4,12 @@
 #include <assert.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
+#include <stdlib.h>
+#include <limits.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 
 void stacktutorial(lua_State* lua);
@@ -16,6 +22,7 @@ void registry(lua_State* lua);
 void upvaluesClosures(lua_State* lua);
 void usingUserdata(lua_State* lua);
 void buidingVectorTable(lua_State* lua);
+void benchmarkVectorDistance(lua_State* lua);
 
 
 int main()
@@ -41,6 +48,7 @@ int main()
 
 	// usingUserdata(lua);
 	// buidingVectorTable(lua);
+	// benchmarkVectorDistance(lua);
 
 	// when the program quit you should close lua_State
 	lua_close(lua);
@@ -419,7 +427,7 @@ int newCounter (lua_State *L) {
 	return 1;
 }
 
-#define text(x) #x
+#define text(...) #__VA_ARGS__
 
 void upvaluesClosures(lua_State* lua)
 {
@@ -529,22 +537,23 @@ void usingUserdata(lua_State* lua)
 
 /************* Building Vector Tables **************/
 
-int vector_new(lua_State* lua);
-int vector_distance(lua_State* lua);
+// Vectors are userdata with fixed storage for up to four components instead of
+// a table (plus a metatable) per vector. Every vector shares one metatable, and
+// every vector function is a closure holding that metatable as first upvalue.
 
+typedef struct {
+	int size; // 2, 3 or 4
+	lua_Number v[4];
+} Vector;
+
+void openVector(lua_State* lua);
+void openVectorArray(lua_State* lua);
 
 void buidingVectorTable(lua_State* lua)
 {
 	lua_settop(lua, 0);
 
-	lua_newtable(lua);
-	setfunction(vector_distance, "distance");
-	setfunction(vector_new, "new");
-		lua_newtable(lua);
-		setfunction(vector_new, "__call");
-	lua_setmetatable(lua, 1);
-
-	lua_setglobal(lua, "Vector");
+	openVector(lua);
 
 	lua_getglobal(lua, "useVector");
 	if (lua_pcall(lua, 0, 0, 0)){
@@ -552,42 +561,809 @@ void buidingVectorTable(lua_State* lua)
 	}
 }
 
+int isUserdataOf(lua_State* lua, int index, int metatable)
+{
+	if (lua_type(lua, index) != LUA_TUSERDATA || !lua_getmetatable(lua, index))
+		return 0;
+	int same = lua_rawequal(lua, -1, metatable);
+	lua_pop(lua, 1);
+	return same;
+}
+
+int isVector(lua_State* lua, int index)
+{
+	return isUserdataOf(lua, index, lua_upvalueindex(1));
+}
+
+Vector* checkVector(lua_State* lua, int arg)
+{
+	luaL_argcheck(lua, isVector(lua, arg), arg, "expected a vector");
+	return lua_touserdata(lua, arg);
+}
+
+// metatable must be an upvalue or absolute index
+Vector* pushVectorOf(lua_State* lua, int size, int metatable)
+{
+	Vector* vec = lua_newuserdata(lua, sizeof(Vector));
+	memset(vec, 0, sizeof(Vector));
+	vec->size = size;
+	lua_pushvalue(lua, metatable);
+	lua_setmetatable(lua, -2);
+	return vec;
+}
+
+Vector* pushVector(lua_State* lua, int size)
+{
+	return pushVectorOf(lua, size, lua_upvalueindex(1));
+}
+
+// the component named by the key at the given index: x, y, z, w or -1
+int vectorComponent(lua_State* lua, int index)
+{
+	size_t length;
+	if (lua_type(lua, index) != LUA_TSTRING)
+		return -1;
+	const char* key = lua_tolstring(lua, index, &length);
+	if (length != 1)
+		return -1;
+	switch (key[0]) {
+		case 'x': return 0;
+		case 'y': return 1;
+		case 'z': return 2;
+		case 'w': return 3;
+		default: return -1;
+	}
+}
+
+// builds a vector from the components at first, first+1, ...; missing ones are 0
+int newVector(lua_State* lua, int first, int size)
+{
+	Vector* vec = pushVector(lua, size);
+	for (int i = 0; i < size; i++)
+		vec->v[i] = luaL_optnumber(lua, first + i, 0);
+	return 1;
+}
+
+// Vector.new(x, y [, z [, w]]) picks the size from the number of components
 int vector_new(lua_State* lua)
 {
-	if (lua_isnoneornil(lua, 2)) lua_pushnumber(lua, 0);
-	if (lua_isnoneornil(lua, 3)) lua_pushnumber(lua, 0);
+	int size = lua_gettop(lua);
+	luaL_argcheck(lua, size <= 4, 5, "vectors have at most four components");
+	return newVector(lua, 1, size < 2 ? 2 : size);
+}
 
-	lua_newtable(lua);
-	lua_insert(lua, 1);
+// Vector(x, y [, z [, w]])
+int vector_call(lua_State* lua)
+{
+	lua_remove(lua, 1);
+	return vector_new(lua);
+}
 
-	lua_setfield(lua, 1, "y");
-	lua_setfield(lua, 1, "x");
+// Vector2(x, y), Vector3(x, y, z) and Vector4(x, y, z, w); the size is upvalue 2
+int vector_sized(lua_State* lua)
+{
+	return newVector(lua, 1, (int)lua_tointeger(lua, lua_upvalueindex(2)));
+}
 
-	lua_newtable(lua);
-	lua_insert(lua, 2);
-	lua_setfield(lua, 2, "__index");
+// __index: x, y, z and w read the components, other keys find the methods table (upvalue 2)
+int vector_get(lua_State* lua)
+{
+	Vector* vec = checkVector(lua, 1);
+	int i = vectorComponent(lua, 2);
+	if (0 <= i && i < vec->size) {
+		lua_pushnumber(lua, vec->v[i]);
+		return 1;
+	}
+	lua_pushvalue(lua, 2);
+	lua_rawget(lua, lua_upvalueindex(2));
+	return 1;
+}
 
-	lua_setmetatable(lua, 1);
+// __newindex
+int vector_set(lua_State* lua)
+{
+	Vector* vec = checkVector(lua, 1);
+	int i = vectorComponent(lua, 2);
+	luaL_argcheck(lua, 0 <= i && i < vec->size, 2, "no such component");
+	vec->v[i] = luaL_checknumber(lua, 3);
+	return 0;
+}
+
+Vector* checkSameSize(lua_State* lua, Vector* a, int arg)
+{
+	Vector* b = checkVector(lua, arg);
+	luaL_argcheck(lua, a->size == b->size, arg, "vectors must have the same size");
+	return b;
+}
+
+// __add
+int vector_add(lua_State* lua)
+{
+	Vector* a = checkVector(lua, 1);
+	Vector* b = checkSameSize(lua, a, 2);
+	Vector* r = pushVector(lua, a->size);
+	for (int i = 0; i < a->size; i++)
+		r->v[i] = a->v[i] + b->v[i];
 	return 1;
 }
 
-#define getfield(table, coord) (lua_getfield(lua, table, coord), lua_tonumber(lua, -1))
+// __sub
+int vector_sub(lua_State* lua)
+{
+	Vector* a = checkVector(lua, 1);
+	Vector* b = checkSameSize(lua, a, 2);
+	Vector* r = pushVector(lua, a->size);
+	for (int i = 0; i < a->size; i++)
+		r->v[i] = a->v[i] - b->v[i];
+	return 1;
+}
 
+// __mul: vector * number, number * vector or, component-wise, vector * vector
+int vector_mul(lua_State* lua)
+{
+	lua_settop(lua, 2);
+	if (lua_type(lua, 1) == LUA_TNUMBER)
+		lua_rotate(lua, 1, 1); // the vector goes first
+	Vector* a = checkVector(lua, 1);
+	Vector* r;
+	if (lua_type(lua, 2) == LUA_TNUMBER) {
+		lua_Number k = lua_tonumber(lua, 2);
+		r = pushVector(lua, a->size);
+		for (int i = 0; i < a->size; i++)
+			r->v[i] = a->v[i] * k;
+	}
+	else {
+		Vector* b = checkSameSize(lua, a, 2);
+		r = pushVector(lua, a->size);
+		for (int i = 0; i < a->size; i++)
+			r->v[i] = a->v[i] * b->v[i];
+	}
+	return 1;
+}
+
+// __unm
+int vector_unm(lua_State* lua)
+{
+	Vector* a = checkVector(lua, 1);
+	Vector* r = pushVector(lua, a->size);
+	for (int i = 0; i < a->size; i++)
+		r->v[i] = -a->v[i];
+	return 1;
+}
+
+// __eq
+int vector_eq(lua_State* lua)
+{
+	int equal = isVector(lua, 1) && isVector(lua, 2);
+	if (equal) {
+		Vector* a = lua_touserdata(lua, 1);
+		Vector* b = lua_touserdata(lua, 2);
+		equal = a->size == b->size;
+		for (int i = 0; equal && i < a->size; i++)
+			equal = a->v[i] == b->v[i];
+	}
+	lua_pushboolean(lua, equal);
+	return 1;
+}
+
+// __tostring
+int vector_tostring(lua_State* lua)
+{
+	Vector* vec = checkVector(lua, 1);
+	luaL_Buffer b;
+	luaL_buffinit(lua, &b);
+	luaL_addstring(&b, "Vector(");
+	for (int i = 0; i < vec->size; i++) {
+		if (i > 0) luaL_addstring(&b, ", ");
+		lua_pushnumber(lua, vec->v[i]);
+		luaL_addvalue(&b);
+	}
+	luaL_addchar(&b, ')');
+	luaL_pushresult(&b);
+	return 1;
+}
+
+double vectorDot(Vector* a, Vector* b)
+{
+	double dot = 0;
+	for (int i = 0; i < a->size; i++)
+		dot += a->v[i] * b->v[i];
+	return dot;
+}
+
+int vector_dot(lua_State* lua)
+{
+	Vector* a = checkVector(lua, 1);
+	Vector* b = checkSameSize(lua, a, 2);
+	lua_pushnumber(lua, vectorDot(a, b));
+	return 1;
+}
+
+int vector_length(lua_State* lua)
+{
+	Vector* a = checkVector(lua, 1);
+	lua_pushnumber(lua, sqrt(vectorDot(a, a)));
+	return 1;
+}
+
+// Reads the components of a Vector, or of a table shaped like {x = .., y = ..}, into v
+// and returns the vector size. Userdata is copied straight from C memory. Tables are
+// read with lua_rawget using the key strings cached as upvalues 2 to 5, so no string
+// is created or hashed and no __index metamethod runs.
+int toComponents(lua_State* lua, int arg, lua_Number v[4])
+{
+	if (isVector(lua, arg)) {
+		Vector* vec = lua_touserdata(lua, arg);
+		memcpy(v, vec->v, sizeof(vec->v));
+		return vec->size;
+	}
+	luaL_argcheck(lua, lua_istable(lua, arg), arg, "expected a vector");
+	int size = 0;
+	for (; size < 4; size++) {
+		lua_pushvalue(lua, lua_upvalueindex(2 + size));
+		if (lua_rawget(lua, arg) == LUA_TNIL) {
+			lua_pop(lua, 1);
+			break;
+		}
+		int isnum;
+		v[size] = lua_tonumberx(lua, -1, &isnum);
+		lua_pop(lua, 1);
+		luaL_argcheck(lua, isnum, arg, "vector component is not a number");
+	}
+	luaL_argcheck(lua, size >= 2, arg, "expected a vector");
+	return size;
+}
+
+// vec:distance(other) also accepts table vectors on either side
 int vector_distance(lua_State* lua)
 {
-	luaL_checktype(lua, 1, LUA_TTABLE);
-	luaL_checktype(lua, 2, LUA_TTABLE);
+	lua_Number a[4], b[4];
+	int size = toComponents(lua, 1, a);
+	luaL_argcheck(lua, toComponents(lua, 2, b) == size, 2, "vectors must have the same size");
+	double d = 0;
+	for (int i = 0; i < size; i++)
+		d += (a[i] - b[i]) * (a[i] - b[i]);
+	lua_pushnumber(lua, sqrt(d));
+	return 1;
+}
 
-	double x = getfield(1, "x");
-	double y = getfield(1, "y");
-	x -= getfield(2, "x");
-	y -= getfield(2, "y");
+// sets distance in the table on top with the metatable and the component keys as upvalues
+void setDistance(lua_State* lua, int metatable)
+{
+	lua_pushvalue(lua, metatable);
+	lua_pushliteral(lua, "x");
+	lua_pushliteral(lua, "y");
+	lua_pushliteral(lua, "z");
+	lua_pushliteral(lua, "w");
+	lua_pushcclosure(lua, vector_distance, 5);
+	lua_setfield(lua, -2, "distance");
+}
 
-	lua_settop(lua, 0);
-	lua_pushnumber(lua, sqrt(x*x + y*y));
+// returns a new vector with length 1; the zero vector stays zero
+int vector_normalize(lua_State* lua)
+{
+	Vector* a = checkVector(lua, 1);
+	double length = sqrt(vectorDot(a, a));
+	Vector* r = pushVector(lua, a->size);
+	for (int i = 0; i < a->size; i++)
+		r->v[i] = length > 0 ? a->v[i] / length : 0;
+	return 1;
+}
+
+const luaL_Reg vector_metamethods[] = {
+	{"__newindex", vector_set},
+	{"__add", vector_add},
+	{"__sub", vector_sub},
+	{"__mul", vector_mul},
+	{"__unm", vector_unm},
+	{"__eq", vector_eq},
+	{"__tostring", vector_tostring},
+	{NULL, NULL}
+};
+
+// vec:dot(other) or Vector.dot(vec, other); distance is set by setDistance
+const luaL_Reg vector_methods[] = {
+	{"dot", vector_dot},
+	{"length", vector_length},
+	{"normalize", vector_normalize},
+	{NULL, NULL}
+};
+
+void openVector(lua_State* lua)
+{
+	luaL_newmetatable(lua, "Vector");
+	int metatable = lua_gettop(lua);
+	lua_pushvalue(lua, metatable);
+	luaL_setfuncs(lua, vector_metamethods, 1);
+	lua_pushvalue(lua, metatable);
+		lua_newtable(lua); // methods
+		lua_pushvalue(lua, metatable);
+		luaL_setfuncs(lua, vector_methods, 1);
+		setDistance(lua, metatable);
+	lua_pushcclosure(lua, vector_get, 2);
+	lua_setfield(lua, metatable, "__index");
+
+	lua_newtable(lua);
+	lua_pushvalue(lua, metatable);
+	luaL_setfuncs(lua, vector_methods, 1);
+	setDistance(lua, metatable);
+	lua_pushvalue(lua, metatable);
+	lua_pushcclosure(lua, vector_new, 1);
+	lua_setfield(lua, -2, "new");
+		lua_newtable(lua);
+		lua_pushvalue(lua, metatable);
+		lua_pushcclosure(lua, vector_call, 1);
+		lua_setfield(lua, -2, "__call");
+	lua_setmetatable(lua, -2);
+	lua_setglobal(lua, "Vector");
+
+	const char* names[] = {"Vector2", "Vector3", "Vector4"};
+	for (int size = 2; size <= 4; size++) {
+		lua_pushvalue(lua, metatable);
+		lua_pushinteger(lua, size);
+		lua_pushcclosure(lua, vector_sized, 2);
+		lua_setglobal(lua, names[size - 2]);
+	}
+
+	lua_settop(lua, metatable - 1);
+
+	openVectorArray(lua);
+}
+
+/************* Benchmarking vector distance **************/
+
+// runs the chunk on top of the stack with n as its argument and prints the time per call
+void timeDistanceCalls(lua_State* lua, const char* name, lua_Integer n)
+{
+	lua_pushinteger(lua, n);
+	clock_t start = clock();
+	if (lua_pcall(lua, 1, 0, 0)) {
+		printf("%s: %s\n", name, lua_tostring(lua, -1));
+		lua_pop(lua, 1);
+		return;
+	}
+	double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+	printf("%-32s %8.2f ns/call\n", name, seconds * 1e9 / n);
+}
+
+void benchmarkVectorDistance(lua_State* lua)
+{
+	const lua_Integer n = 10000000;
+
+	openVector(lua);
+
+	luaL_loadstring(lua, text(
+		local n = ...;
+		local a = Vector(12, 14);
+		local b = Vector(8, 11);
+		local d = 0;
+		for i = 1, n do d = d + a:distance(b) end
+	));
+	timeDistanceCalls(lua, "userdata a:distance(b)", n);
+
+	luaL_loadstring(lua, text(
+		local n = ...;
+		local a = {x = 12, y = 14};
+		local b = {x = 8, y = 11};
+		local distance = Vector.distance;
+		local d = 0;
+		for i = 1, n do d = d + distance(a, b) end
+	));
+	timeDistanceCalls(lua, "table Vector.distance(a, b)", n);
+
+	luaL_loadstring(lua, text(
+		local n = ...;
+		local a = {x = 12, y = 14};
+		local b = {x = 8, y = 11};
+		local sqrt = math.sqrt;
+		local function distance(a, b)
+			local dx = a.x - b.x;
+			local dy = a.y - b.y;
+			return sqrt(dx * dx + dy * dy)
+		end
+		local d = 0;
+		for i = 1, n do d = d + distance(a, b) end
+	));
+	timeDistanceCalls(lua, "table Lua distance(a, b)", n);
+}
+
+/************* Structure-of-arrays VectorArray **************/
+
+// A VectorArray keeps each component in its own contiguous buffer - all x, then
+// all y, then all z - so batch passes stream through memory and every SSE2
+// register holds the same component of two vectors. Its functions have the
+// VectorArray metatable as upvalue 1 and the Vector metatable as upvalue 2.
+
+typedef struct {
+	int dimension; // 2 or 3
+	size_t size;
+	size_t capacity;
+	double* c[3];  // x, y and z
+} VectorArray;
+
+VectorArray* checkVectorArray(lua_State* lua, int arg)
+{
+	luaL_argcheck(lua, isUserdataOf(lua, arg, lua_upvalueindex(1)), arg, "expected a vector array");
+	return lua_touserdata(lua, arg);
+}
+
+// a Vector with the dimension of the array
+Vector* checkPoint(lua_State* lua, VectorArray* va, int arg)
+{
+	luaL_argcheck(lua, isUserdataOf(lua, arg, lua_upvalueindex(2)), arg, "expected a vector");
+	Vector* p = lua_touserdata(lua, arg);
+	luaL_argcheck(lua, p->size == va->dimension, arg, "vector size does not match the array");
+	return p;
+}
+
+void reserveVectorArray(lua_State* lua, VectorArray* va, size_t capacity)
+{
+	if (capacity <= va->capacity)
+		return;
+	size_t grown = va->capacity < 8 ? 8 : va->capacity * 2;
+	if (grown < capacity) grown = capacity;
+	if (grown > SIZE_MAX / sizeof(double))
+		luaL_error(lua, "vector array too large");
+	for (int d = 0; d < va->dimension; d++) {
+		double* c = realloc(va->c[d], grown * sizeof(double));
+		if (c == NULL)
+			luaL_error(lua, "not enough memory");
+		va->c[d] = c;
+	}
+	va->capacity = grown;
+}
+
+/* Batch kernels, one pass per component buffer */
+
+// out[i] = squared distance between vector i and p
+void squaredDistances(VectorArray* va, const double* p, double* out)
+{
+	const double* x = va->c[0];
+	const double* y = va->c[1];
+	const double* z = va->dimension == 3 ? va->c[2] : NULL;
+	size_t n = va->size, i = 0;
+#ifdef __SSE2__
+	__m128d px = _mm_set1_pd(p[0]), py = _mm_set1_pd(p[1]), pz = _mm_set1_pd(z ? p[2] : 0);
+	for (; i + 2 <= n; i += 2) {
+		__m128d dx = _mm_sub_pd(_mm_loadu_pd(x + i), px);
+		__m128d dy = _mm_sub_pd(_mm_loadu_pd(y + i), py);
+		__m128d d2 = _mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy));
+		if (z) {
+			__m128d dz = _mm_sub_pd(_mm_loadu_pd(z + i), pz);
+			d2 = _mm_add_pd(d2, _mm_mul_pd(dz, dz));
+		}
+		_mm_storeu_pd(out + i, d2);
+	}
+#endif
+	for (; i < n; i++) {
+		double dx = x[i] - p[0], dy = y[i] - p[1];
+		out[i] = dx*dx + dy*dy;
+		if (z) out[i] += (z[i] - p[2]) * (z[i] - p[2]);
+	}
+}
+
+void squareRoots(double* v, size_t n)
+{
+	size_t i = 0;
+#ifdef __SSE2__
+	for (; i + 2 <= n; i += 2)
+		_mm_storeu_pd(v + i, _mm_sqrt_pd(_mm_loadu_pd(v + i)));
+#endif
+	for (; i < n; i++)
+		v[i] = sqrt(v[i]);
+}
+
+double componentSum(const double* c, size_t n)
+{
+	double sum = 0;
+	size_t i = 0;
+#ifdef __SSE2__
+	__m128d acc = _mm_setzero_pd();
+	for (; i + 2 <= n; i += 2)
+		acc = _mm_add_pd(acc, _mm_loadu_pd(c + i));
+	double lanes[2];
+	_mm_storeu_pd(lanes, acc);
+	sum = lanes[0] + lanes[1];
+#endif
+	for (; i < n; i++)
+		sum += c[i];
+	return sum;
+}
+
+// n must not be zero
+void componentBounds(const double* c, size_t n, double* min, double* max)
+{
+	double lo = c[0], hi = c[0];
+	size_t i = 0;
+#ifdef __SSE2__
+	__m128d vlo = _mm_set1_pd(c[0]), vhi = vlo;
+	for (; i + 2 <= n; i += 2) {
+		__m128d v = _mm_loadu_pd(c + i);
+		vlo = _mm_min_pd(vlo, v);
+		vhi = _mm_max_pd(vhi, v);
+	}
+	double l[2], h[2];
+	_mm_storeu_pd(l, vlo);
+	_mm_storeu_pd(h, vhi);
+	lo = l[0] < l[1] ? l[0] : l[1];
+	hi = h[0] > h[1] ? h[0] : h[1];
+#endif
+	for (; i < n; i++) {
+		if (c[i] < lo) lo = c[i];
+		if (c[i] > hi) hi = c[i];
+	}
+	*min = lo;
+	*max = hi;
+}
+
+void componentAdd(double* c, size_t n, double k)
+{
+	size_t i = 0;
+#ifdef __SSE2__
+	__m128d vk = _mm_set1_pd(k);
+	for (; i + 2 <= n; i += 2)
+		_mm_storeu_pd(c + i, _mm_add_pd(_mm_loadu_pd(c + i), vk));
+#endif
+	for (; i < n; i++)
+		c[i] += k;
+}
+
+/* VectorArray functions */
+
+// VectorArray.new([dimension [, capacity]]) with dimension 2 (default) or 3
+int vectorarray_new(lua_State* lua)
+{
+	lua_Integer dimension = luaL_optinteger(lua, 1, 2);
+	lua_Integer capacity = luaL_optinteger(lua, 2, 0);
+	luaL_argcheck(lua, dimension == 2 || dimension == 3, 1, "dimension must be 2 or 3");
+	luaL_argcheck(lua, capacity >= 0, 2, "invalid capacity");
+	VectorArray* va = lua_newuserdata(lua, sizeof(VectorArray));
+	memset(va, 0, sizeof(VectorArray));
+	va->dimension = (int)dimension;
+	lua_pushvalue(lua, lua_upvalueindex(1));
+	lua_setmetatable(lua, -2);
+	reserveVectorArray(lua, va, capacity);
 	return 1;
 }
 
+// VectorArray(dimension [, capacity])
+int vectorarray_call(lua_State* lua)
+{
+	lua_remove(lua, 1);
+	return vectorarray_new(lua);
+}
+
+// __gc
+int vectorarray_free(lua_State* lua)
+{
+	VectorArray* va = checkVectorArray(lua, 1);
+	for (int d = 0; d < 3; d++) {
+		free(va->c[d]);
+		va->c[d] = NULL;
+	}
+	va->size = va->capacity = 0;
+	return 0;
+}
+
+// __len
+int vectorarray_size(lua_State* lua)
+{
+	VectorArray* va = checkVectorArray(lua, 1);
+	lua_pushinteger(lua, va->size);
+	return 1;
+}
+
+// __index: integer keys return a Vector copy, string keys find the methods table (upvalue 3)
+int vectorarray_get(lua_State* lua)
+{
+	VectorArray* va = checkVectorArray(lua, 1);
+	if (lua_type(lua, 2) == LUA_TSTRING) {
+		lua_pushvalue(lua, 2);
+		lua_rawget(lua, lua_upvalueindex(3));
+		return 1;
+	}
+	lua_Integer i = luaL_checkinteger(lua, 2);
+	luaL_argcheck(lua, 0 < i && (size_t)i <= va->size, 2, "index out of range");
+	Vector* vec = pushVectorOf(lua, va->dimension, lua_upvalueindex(2));
+	for (int d = 0; d < va->dimension; d++)
+		vec->v[d] = va->c[d][i-1];
+	return 1;
+}
+
+// __newindex
+int vectorarray_set(lua_State* lua)
+{
+	VectorArray* va = checkVectorArray(lua, 1);
+	lua_Integer i = luaL_checkinteger(lua, 2);
+	Vector* vec = checkPoint(lua, va, 3);
+	luaL_argcheck(lua, 0 < i && (size_t)i <= va->size, 2, "index out of range");
+	for (int d = 0; d < va->dimension; d++)
+		va->c[d][i-1] = vec->v[d];
+	return 0;
+}
+
+// va:add(vector) or va:add(x, y [, z])
+int vectorarray_add(lua_State* lua)
+{
+	VectorArray* va = checkVectorArray(lua, 1);
+	double v[3] = {0, 0, 0};
+	if (lua_type(lua, 2) == LUA_TUSERDATA) {
+		Vector* vec = checkPoint(lua, va, 2);
+		for (int d = 0; d < va->dimension; d++)
+			v[d] = vec->v[d];
+	}
+	else {
+		for (int d = 0; d < va->dimension; d++)
+			v[d] = luaL_checknumber(lua, 2 + d);
+	}
+	reserveVectorArray(lua, va, va->size + 1);
+	for (int d = 0; d < va->dimension; d++)
+		va->c[d][va->size] = v[d];
+	va->size++;
+	return 0;
+}
+
+// va:distances(point) returns an Array with the distance of every vector to the point. This
+// is the Array of the userdata section above, whose size is an unsigned int, not the typed
+// array module of array.cpp.
+int vectorarray_distances(lua_State* lua)
+{
+	VectorArray* va = checkVectorArray(lua, 1);
+	Vector* p = checkPoint(lua, va, 2);
+	luaL_argcheck(lua, va->size <= UINT_MAX, 1, "too many vectors for an Array");
+	Array* out = createArray(lua, va->size);
+	squaredDistances(va, p->v, out->data);
+	squareRoots(out->data, va->size);
+	return 1;
+}
+
+// va:nearest(point, k) returns a table with the indices of the k nearest vectors, nearest first
+int vectorarray_nearest(lua_State* lua)
+{
+	VectorArray* va = checkVectorArray(lua, 1);
+	Vector* p = checkPoint(lua, va, 2);
+	lua_Integer k = luaL_checkinteger(lua, 3);
+	luaL_argcheck(lua, k >= 0, 3, "k must not be negative");
+	if ((size_t)k > va->size) k = va->size;
+
+	// scratch buffers are userdata so an error cannot leak them
+	double* d2 = lua_newuserdata(lua, va->size * sizeof(double) + 1);
+	size_t* heap = lua_newuserdata(lua, k * sizeof(size_t) + 1);
+	squaredDistances(va, p->v, d2);
+
+	// max-heap of the k nearest seen so far, keyed by squared distance
+	size_t count = 0;
+	for (size_t i = 0; i < va->size; i++) {
+		size_t at;
+		if (count < (size_t)k) {
+			at = count++;
+			while (at > 0 && d2[heap[(at - 1) / 2]] < d2[i]) {
+				heap[at] = heap[(at - 1) / 2];
+				at = (at - 1) / 2;
+			}
+		}
+		else if (k > 0 && d2[i] < d2[heap[0]]) {
+			at = 0;
+			for (;;) {
+				size_t child = 2 * at + 1;
+				if (child >= count) break;
+				if (child + 1 < count && d2[heap[child + 1]] > d2[heap[child]]) child++;
+				if (d2[heap[child]] <= d2[i]) break;
+				heap[at] = heap[child];
+				at = child;
+			}
+		}
+		else continue;
+		heap[at] = i;
+	}
+
+	// popping the max-heap yields the farthest first, so fill the table from the end
+	lua_createtable(lua, (int)count, 0);
+	for (size_t n = count; n > 0; n--) {
+		lua_pushinteger(lua, heap[0] + 1);
+		lua_rawseti(lua, -2, n);
+		size_t last = heap[n - 1], at = 0;
+		for (;;) {
+			size_t child = 2 * at + 1;
+			if (child >= n - 1) break;
+			if (child + 1 < n - 1 && d2[heap[child + 1]] > d2[heap[child]]) child++;
+			if (d2[heap[child]] <= d2[last]) break;
+			heap[at] = heap[child];
+			at = child;
+		}
+		heap[at] = last;
+	}
+	return 1;
+}
+
+// va:bounds() returns the min and max corners of the bounding box; nothing if empty
+int vectorarray_bounds(lua_State* lua)
+{
+	VectorArray* va = checkVectorArray(lua, 1);
+	if (va->size == 0)
+		return 0;
+	Vector* min = pushVectorOf(lua, va->dimension, lua_upvalueindex(2));
+	Vector* max = pushVectorOf(lua, va->dimension, lua_upvalueindex(2));
+	for (int d = 0; d < va->dimension; d++)
+		componentBounds(va->c[d], va->size, &min->v[d], &max->v[d]);
+	return 2;
+}
+
+// va:centroid() returns the mean of the vectors; nothing if empty
+int vectorarray_centroid(lua_State* lua)
+{
+	VectorArray* va = checkVectorArray(lua, 1);
+	if (va->size == 0)
+		return 0;
+	Vector* c = pushVectorOf(lua, va->dimension, lua_upvalueindex(2));
+	for (int d = 0; d < va->dimension; d++)
+		c->v[d] = componentSum(va->c[d], va->size) / va->size;
+	return 1;
+}
+
+// va:translate(offset) adds the offset vector to every vector in place
+int vectorarray_translate(lua_State* lua)
+{
+	VectorArray* va = checkVectorArray(lua, 1);
+	Vector* offset = checkPoint(lua, va, 2);
+	for (int d = 0; d < va->dimension; d++)
+		componentAdd(va->c[d], va->size, offset->v[d]);
+	return 0;
+}
+
+const luaL_Reg vectorarray_metamethods[] = {
+	{"__newindex", vectorarray_set},
+	{"__len", vectorarray_size},
+	{"__gc", vectorarray_free},
+	{NULL, NULL}
+};
+
+const luaL_Reg vectorarray_methods[] = {
+	{"size", vectorarray_size},
+	{"add", vectorarray_add},
+	{"distances", vectorarray_distances},
+	{"nearest", vectorarray_nearest},
+	{"bounds", vectorarray_bounds},
+	{"centroid", vectorarray_centroid},
+	{"translate", vectorarray_translate},
+	{NULL, NULL}
+};
+
+// needs the Vector metatable registered by openVector
+void openVectorArray(lua_State* lua)
+{
+	luaL_getmetatable(lua, "Vector");
+	int vector = lua_gettop(lua);
+	luaL_newmetatable(lua, "VectorArray");
+	int metatable = lua_gettop(lua);
+
+	lua_pushvalue(lua, metatable);
+	lua_pushvalue(lua, vector);
+	luaL_setfuncs(lua, vectorarray_metamethods, 2);
+	lua_pushvalue(lua, metatable);
+	lua_pushvalue(lua, vector);
+		lua_newtable(lua); // methods
+		lua_pushvalue(lua, metatable);
+		lua_pushvalue(lua, vector);
+		luaL_setfuncs(lua, vectorarray_methods, 2);
+	lua_pushcclosure(lua, vectorarray_get, 3);
+	lua_setfield(lua, metatable, "__index");
+
+	lua_newtable(lua);
+	lua_pushvalue(lua, metatable);
+	lua_pushvalue(lua, vector);
+	lua_pushcclosure(lua, vectorarray_new, 2);
+	lua_setfield(lua, -2, "new");
+		lua_newtable(lua);
+		lua_pushvalue(lua, metatable);
+		lua_pushvalue(lua, vector);
+		lua_pushcclosure(lua, vectorarray_call, 2);
+		lua_setfield(lua, -2, "__call");
+	lua_setmetatable(lua, -2);
+	lua_setglobal(lua, "VectorArray");
+
+	lua_settop(lua, vector - 1);
+}
 
 
 struct vxWindow
@@ -0,0 +1,249 @@
+#ifndef LUA_FUNCTION_H
+#define LUA_FUNCTION_H
+
+#include <lua.hpp>
+#include <string>
+#include <tuple>
+#include <stdexcept>
+#include <type_traits>
+#include <limits>
+
+// a Lua error or a result of the wrong type, raised in C++
+class LuaError : public std::runtime_error {
+public:
+	explicit LuaError(const std::string& message) : std::runtime_error(message) {}
+};
+
+/************* Typed values **************/
+
+// How each C++ type crosses into Lua: push, to for results (raises LuaError on a mismatch)
+// and check for arguments of bound C functions (raises a Lua argument error). check returns
+// an Arg that owns no memory, so a later argument error cannot leak it.
+template <typename T, typename Enable = void>
+struct LuaType;
+
+template <>
+struct LuaType<bool> {
+	typedef bool Arg;
+	static void push(lua_State* lua, bool v) { lua_pushboolean(lua, v); }
+	static bool to(lua_State* lua, int index) { return lua_toboolean(lua, index) != 0; }
+	static bool check(lua_State* lua, int arg)
+	{
+		luaL_checkany(lua, arg);
+		return lua_toboolean(lua, arg) != 0;
+	}
+};
+
+template <typename T>
+struct LuaType<T, typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value>::type> {
+	typedef T Arg;
+	static void push(lua_State* lua, T v) { lua_pushinteger(lua, (lua_Integer)v); }
+	static bool fits(lua_Integer v)
+	{
+		if (std::is_unsigned<T>::value)
+			return v >= 0 && (unsigned long long)v <= (unsigned long long)std::numeric_limits<T>::max();
+		return v >= (lua_Integer)std::numeric_limits<T>::min() && v <= (lua_Integer)std::numeric_limits<T>::max();
+	}
+	static T check(lua_State* lua, int arg)
+	{
+		lua_Integer v = luaL_checkinteger(lua, arg);
+		luaL_argcheck(lua, fits(v), arg, "integer out of range");
+		return (T)v;
+	}
+	static T to(lua_State* lua, int index)
+	{
+		int isnum;
+		lua_Integer v = lua_tointegerx(lua, index, &isnum);
+		if (!isnum)
+			throw LuaError(std::string("expected an integer result, got ") + luaL_typename(lua, index));
+		return (T)v;
+	}
+};
+
+template <typename T>
+struct LuaType<T, typename std::enable_if<std::is_floating_point<T>::value>::type> {
+	typedef T Arg;
+	static void push(lua_State* lua, T v) { lua_pushnumber(lua, (lua_Number)v); }
+	static T check(lua_State* lua, int arg) { return (T)luaL_checknumber(lua, arg); }
+	static T to(lua_State* lua, int index)
+	{
+		int isnum;
+		lua_Number v = lua_tonumberx(lua, index, &isnum);
+		if (!isnum)
+			throw LuaError(std::string("expected a number result, got ") + luaL_typename(lua, index));
+		return (T)v;
+	}
+};
+
+// the characters of a string argument; becomes a std::string only when the function is called
+struct LuaStringArg {
+	const char* s;
+	size_t length;
+	operator std::string() const { return std::string(s, length); }
+};
+
+template <>
+struct LuaType<std::string> {
+	typedef LuaStringArg Arg;
+	static void push(lua_State* lua, const std::string& v) { lua_pushlstring(lua, v.data(), v.size()); }
+	static LuaStringArg check(lua_State* lua, int arg)
+	{
+		LuaStringArg v;
+		v.s = luaL_checklstring(lua, arg, &v.length);
+		return v;
+	}
+	static std::string to(lua_State* lua, int index)
+	{
+		size_t length;
+		const char* s = lua_tolstring(lua, index, &length);
+		if (s == NULL)
+			throw LuaError(std::string("expected a string result, got ") + luaL_typename(lua, index));
+		return std::string(s, length);
+	}
+};
+
+// arguments only: the characters would not outlive the popped result
+template <>
+struct LuaType<const char*> {
+	typedef const char* Arg;
+	static void push(lua_State* lua, const char* v) { lua_pushstring(lua, v); }
+	static const char* check(lua_State* lua, int arg) { return luaL_checkstring(lua, arg); }
+};
+
+template <typename T>
+using LuaTypeOf = LuaType<typename std::decay<T>::type>;
+
+/************* Results **************/
+
+template <size_t... I>
+struct LuaIndices {};
+
+template <size_t N, size_t... I>
+struct MakeLuaIndices : MakeLuaIndices<N - 1, N - 1, I...> {};
+
+template <size_t... I>
+struct MakeLuaIndices<0, I...> {
+	typedef LuaIndices<I...> type;
+};
+
+// how many results a call keeps and how they are read, from the first result at index
+template <typename R>
+struct LuaResults {
+	static const int count = 1;
+	static R get(lua_State* lua, int index) { return LuaTypeOf<R>::to(lua, index); }
+};
+
+template <>
+struct LuaResults<void> {
+	static const int count = 0;
+	static void get(lua_State*, int) {}
+};
+
+// multiple results
+template <typename... T>
+struct LuaResults<std::tuple<T...> > {
+	static const int count = sizeof...(T);
+	static std::tuple<T...> get(lua_State* lua, int index)
+	{
+		return get(lua, index, typename MakeLuaIndices<sizeof...(T)>::type());
+	}
+	template <size_t... I>
+	static std::tuple<T...> get(lua_State* lua, int index, LuaIndices<I...>)
+	{
+		return std::tuple<T...>(LuaTypeOf<T>::to(lua, index + (int)I)...);
+	}
+};
+
+/************* Function handles **************/
+
+// restores the stack top when a call returns or throws
+struct LuaStackGuard {
+	lua_State* lua;
+	int top;
+	explicit LuaStackGuard(lua_State* lua) : lua(lua), top(lua_gettop(lua)) {}
+	~LuaStackGuard() { lua_settop(lua, top); }
+};
+
+template <typename Signature>
+class LuaFunction;
+
+// A Lua function pinned in the registry with luaL_ref and called with typed arguments
+// and results, e.g. LuaFunction<double(double, double)> or LuaFunction<std::tuple<int, std::string>(int)>.
+// Calling it is lua_rawgeti on the registry's array part, pushes and lua_pcall; there is
+// no lookup by name. A call that fails, or returns a value of the wrong type, throws
+// LuaError and leaves the stack as it was. The handle must not outlive its state.
+template <typename R, typename... Args>
+class LuaFunction<R(Args...)> {
+public:
+	LuaFunction() : lua(NULL), ref(LUA_NOREF) {}
+
+	// pins the value at the given index
+	LuaFunction(lua_State* lua, int index) : lua(lua)
+	{
+		lua_pushvalue(lua, index);
+		ref = luaL_ref(lua, LUA_REGISTRYINDEX);
+	}
+
+	// pins the global with the given name; it is looked up only here
+	LuaFunction(lua_State* lua, const char* global) : lua(lua)
+	{
+		lua_getglobal(lua, global);
+		ref = luaL_ref(lua, LUA_REGISTRYINDEX);
+	}
+
+	LuaFunction(LuaFunction&& other) : lua(other.lua), ref(other.ref)
+	{
+		other.lua = NULL;
+		other.ref = LUA_NOREF;
+	}
+
+	LuaFunction& operator=(LuaFunction&& other)
+	{
+		if (this != &other) {
+			release();
+			lua = other.lua;
+			ref = other.ref;
+			other.lua = NULL;
+			other.ref = LUA_NOREF;
+		}
+		return *this;
+	}
+
+	~LuaFunction() { release(); }
+
+	// false for a default handle or one that pinned nil
+	explicit operator bool() const { return lua != NULL && ref != LUA_REFNIL && ref != LUA_NOREF; }
+
+	// pushes the pinned function
+	void push() const { lua_rawgeti(lua, LUA_REGISTRYINDEX, ref); }
+
+	R operator()(Args... args) const
+	{
+		LuaStackGuard guard(lua);
+		lua_rawgeti(lua, LUA_REGISTRYINDEX, ref);
+		int pushed[] = {0, (LuaTypeOf<Args>::push(lua, args), 0)...};
+		(void)pushed;
+		if (lua_pcall(lua, (int)sizeof...(Args), LuaResults<R>::count, 0) != LUA_OK) {
+			const char* message = lua_tostring(lua, -1);
+			throw LuaError(message ? message : "error object is not a string");
+		}
+		return LuaResults<R>::get(lua, guard.top + 1);
+	}
+
+private:
+	lua_State* lua;
+	int ref;
+
+	void release()
+	{
+		if (lua != NULL)
+			luaL_unref(lua, LUA_REGISTRYINDEX, ref);
+		lua = NULL;
+		ref = LUA_NOREF;
+	}
+
+	LuaFunction(const LuaFunction&) = delete;
+	LuaFunction& operator=(const LuaFunction&) = delete;
+};
+
+#endif
@@ -0,0 +1 @@
+g++ -std=c++17 -Llua -Ilua %* array.cpp -llua53 -o array
@@ -0,0 +1 @@
+g++ -std=c++17 -pthread -DARRAY_NO_MAIN -Llua -Ilua %* bench.cpp array.cpp state_pool.cpp executor.cpp state_alloc.cpp chunk_cache.cpp snippet_cache.cpp protected_call.cpp scheduler.cpp channel.cpp -llua53 -o bench
@@ -1 +1 @@
-gcc -Llua -Ilua %1 -llua53
+gcc -Llua -Ilua %* -llua53
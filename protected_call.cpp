@@ -0,0 +1,203 @@
+#include "protected_call.h"
+#include <stdio.h>
+#include <string.h>
+
+static void copyString(char* to, size_t size, const char* from)
+{
+	if (from == NULL)
+		from = "";
+	strncpy(to, from, size - 1);
+	to[size - 1] = '\0';
+}
+
+/************* Errors **************/
+
+// Copies the frames of the failing stack while it still exists. lua_getinfo with "Sln"
+// allocates nothing, so the handler cannot fail with a memory error of its own.
+void ScriptError::capture(lua_State* thread)
+{
+	lua_Debug ar;
+	frames = 0;
+	innermost = -1;
+	if (!traced) {
+		// the innermost Lua frame only: skips the C function that raised, if any
+		for (int level = 1; lua_getstack(thread, level, &ar); level++) {
+			lua_getinfo(thread, "Sl", &ar);
+			if (ar.currentline <= 0)
+				continue;
+			ScriptFrame& frame = stack[0];
+			memcpy(frame.source, ar.short_src, sizeof(frame.source));
+			frame.line = ar.currentline;
+			frame.lineDefined = ar.linedefined;
+			frame.name[0] = frame.kind[0] = '\0';
+			frame.what = ar.what[0] == 'm' ? 'm' : 'L';
+			frames = 1;
+			innermost = 0;
+			return;
+		}
+		return;
+	}
+	for (int level = 1; lua_getstack(thread, level, &ar); level++, frames++) {
+		if (frames >= SCRIPT_ERROR_FRAMES)
+			continue;
+		lua_getinfo(thread, "Sln", &ar);
+		ScriptFrame& frame = stack[frames];
+		memcpy(frame.source, ar.short_src, sizeof(frame.source));
+		frame.line = ar.currentline;
+		frame.lineDefined = ar.linedefined;
+		copyString(frame.name, sizeof(frame.name), ar.name);
+		copyString(frame.kind, sizeof(frame.kind), ar.namewhat);
+		frame.what = ar.what[0] == 'm' ? 'm' : ar.what[0] == 'C' ? 'C' : 'L';
+		if (innermost < 0 && frame.line > 0)
+			innermost = frames;
+	}
+}
+
+// the message handler: keeps the error value as it is
+int ScriptError::handle(lua_State* lua)
+{
+	ScriptError* error = (ScriptError*)lua_touserdata(lua, lua_upvalueindex(1));
+	error->capture(lua);
+	return 1;
+}
+
+const char* ScriptError::message()
+{
+	if (code == LUA_OK)
+		return "";
+	int top = lua_gettop(lua);
+	lua_rawgeti(lua, LUA_REGISTRYINDEX, ref);
+	if (lua_type(lua, -1) != LUA_TSTRING) {
+		// converted once and stored back, so the pointer stays valid; __tostring is not
+		// called because it could raise an error outside any protected call
+		if (lua_type(lua, -1) == LUA_TNUMBER)
+			lua_tostring(lua, -1);
+		else
+			lua_pushfstring(lua, "(error object is a %s value)", luaL_typename(lua, -1));
+		lua_pushvalue(lua, -1);
+		lua_rawseti(lua, LUA_REGISTRYINDEX, ref);
+	}
+	const char* s = lua_tostring(lua, -1);
+	lua_settop(lua, top);
+	return s;
+}
+
+const char* ScriptError::file() const
+{
+	return code != LUA_OK && innermost >= 0 ? stack[innermost].source : "";
+}
+
+int ScriptError::line() const
+{
+	return code != LUA_OK && innermost >= 0 ? stack[innermost].line : -1;
+}
+
+const std::string& ScriptError::traceback()
+{
+	if (formatted)
+		return trace;
+	formatted = true;
+	trace = "stack traceback:";
+	char number[32];
+	for (int i = 0; i < frameCount(); i++) {
+		const ScriptFrame& frame = stack[i];
+		trace += "\n\t";
+		trace += frame.source;
+		trace += ":";
+		if (frame.line > 0) {
+			snprintf(number, sizeof(number), "%d:", frame.line);
+			trace += number;
+		}
+		trace += " in ";
+		if (frame.kind[0] != '\0') {
+			trace += frame.kind;
+			trace += " '";
+			trace += frame.name;
+			trace += "'";
+		}
+		else if (frame.what == 'm') {
+			trace += "main chunk";
+		}
+		else if (frame.what == 'C') {
+			trace += "?";
+		}
+		else {
+			snprintf(number, sizeof(number), ":%d>", frame.lineDefined);
+			trace += "function <";
+			trace += frame.source;
+			trace += number;
+		}
+	}
+	if (frames > SCRIPT_ERROR_FRAMES) {
+		snprintf(number, sizeof(number), "%d", frames - SCRIPT_ERROR_FRAMES);
+		trace += "\n\t...\t(skipping ";
+		trace += number;
+		trace += " levels)";
+	}
+	return trace;
+}
+
+/************* Protected calls **************/
+
+ProtectedCall::ProtectedCall(lua_State* lua, bool traceback) : lua(lua)
+{
+	last.lua = lua;
+	last.code = LUA_OK;
+	last.frames = 0;
+	last.innermost = -1;
+	last.traced = traceback;
+	last.formatted = false;
+	lua_pushboolean(lua, 0);
+	last.ref = luaL_ref(lua, LUA_REGISTRYINDEX);
+
+	lua_pushlightuserdata(lua, &last);
+	lua_pushcclosure(lua, ScriptError::handle, 1);
+	handlerIndex = lua_gettop(lua);
+}
+
+ProtectedCall::~ProtectedCall()
+{
+	lua_remove(lua, handlerIndex);
+	luaL_unref(lua, LUA_REGISTRYINDEX, last.ref);
+}
+
+// moves the error value into the registry slot; the frames were captured by the handler
+int ProtectedCall::fail(int status)
+{
+	last.code = status;
+	last.formatted = false;
+	lua_rawseti(lua, LUA_REGISTRYINDEX, last.ref);
+	return status;
+}
+
+int ProtectedCall::call(int nargs, int nresults)
+{
+	// memory errors and errors in the handler do not reach the handler
+	last.frames = 0;
+	last.innermost = -1;
+	int status = lua_pcall(lua, nargs, nresults, handlerIndex);
+	if (status != LUA_OK)
+		return fail(status);
+	last.code = LUA_OK;
+	return LUA_OK;
+}
+
+int ProtectedCall::doString(const char* source)
+{
+	last.frames = 0;
+	last.innermost = -1;
+	int status = luaL_loadstring(lua, source);
+	if (status != LUA_OK)
+		return fail(status);
+	return call(0, LUA_MULTRET);
+}
+
+int ProtectedCall::doFile(const char* path)
+{
+	last.frames = 0;
+	last.innermost = -1;
+	int status = luaL_loadfile(lua, path);
+	if (status != LUA_OK)
+		return fail(status);
+	return call(0, LUA_MULTRET);
+}
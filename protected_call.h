@@ -0,0 +1,96 @@
+#ifndef PROTECTED_CALL_H
+#define PROTECTED_CALL_H
+
+#include <lua.hpp>
+#include <string>
+
+// frames kept from the stack of a failed call when tracebacks are captured; deeper frames
+// are counted but not kept
+#define SCRIPT_ERROR_FRAMES 16
+
+typedef struct {
+	char source[LUA_IDSIZE];
+	int line;           // current line, -1 when unknown
+	int lineDefined;
+	char name[32];      // "" when the function has no known name
+	char kind[16];      // how the name was found: "global", "local", "method"...
+	char what;          // 'L' Lua function, 'C' C function, 'm' main chunk
+} ScriptFrame;
+
+// The last error of a ProtectedCall. The handler only records the chunk and line of the
+// innermost Lua frame, unless the ProtectedCall captures tracebacks: then it copies the
+// stack frames into fixed buffers. The message is converted to a string, and the traceback
+// built, when they are first read. The object and its buffers are reused by every call.
+class ScriptError {
+public:
+	// LUA_OK when the last call succeeded
+	int status() const { return code; }
+
+	// the error value as a string; valid until the next call
+	const char* message();
+
+	// chunk and line of the innermost Lua frame; "" and -1 when unknown
+	const char* file() const;
+	int line() const;
+
+	// formatted like luaL_traceback; only the innermost Lua frame unless tracebacks are captured
+	const std::string& traceback();
+
+	int frameCount() const { return frames < SCRIPT_ERROR_FRAMES ? frames : SCRIPT_ERROR_FRAMES; }
+	const ScriptFrame& frame(int i) const { return stack[i]; }
+
+private:
+	friend class ProtectedCall;
+
+	lua_State* lua;
+	int ref;            // registry slot holding the error value
+	int code;
+	int frames;         // frames on the stack when the error was raised, or 1 without traceback
+	int innermost;      // first frame with a line, or -1
+	bool traced;        // capture every frame, not only the innermost Lua one
+	bool formatted;
+	ScriptFrame stack[SCRIPT_ERROR_FRAMES];
+	std::string trace;
+
+	void capture(lua_State* thread);
+	static int handle(lua_State* lua);
+};
+
+// Protected calls that share one message handler, pushed once by the constructor and
+// then left at that stack slot, so a call does not push it again. Everything the
+// ProtectedCall pushes later goes above it: the slot must not be popped while the object
+// is in use. A failed call moves the error value out of the stack into error(), leaving
+// the stack as it was without the function and its arguments. The destructor removes the
+// handler; destroy the object before closing its state.
+//
+// A caught error costs one lua_getinfo for its innermost Lua frame. With traceback set,
+// the handler walks the whole stack on every error so that error().traceback() can show it.
+class ProtectedCall {
+public:
+	explicit ProtectedCall(lua_State* lua, bool traceback = false);
+	~ProtectedCall();
+
+	// stack index of the message handler
+	int handler() const { return handlerIndex; }
+
+	// like lua_pcall with the handler
+	int call(int nargs, int nresults);
+
+	// like luaL_dostring and luaL_dofile; a syntax error is kept in error() too
+	int doString(const char* source);
+	int doFile(const char* path);
+
+	ScriptError& error() { return last; }
+
+private:
+	lua_State* lua;
+	int handlerIndex;
+	ScriptError last;
+
+	int fail(int status);
+
+	ProtectedCall(const ProtectedCall&) = delete;
+	ProtectedCall& operator=(const ProtectedCall&) = delete;
+};
+
+#endif
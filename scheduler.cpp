@@ -0,0 +1,624 @@
+#include "scheduler.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <new>
+#include <chrono>
+#include <stdexcept>
+
+#ifdef SCHEDULER_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
+static char SchedulerKey;
+
+static double now()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void printTaskError(lua_State* thread)
+{
+	const char* message = lua_tostring(thread, -1);
+	luaL_traceback(thread, thread, message ? message : "(error object is not a string)", 0);
+	fprintf(stderr, "%s\n", lua_tostring(thread, -1));
+	lua_pop(thread, 1);
+}
+
+// the scheduler of the async function being called; upvalue 1 is a box that the
+// destructor empties
+static Scheduler* checkScheduler(lua_State* lua)
+{
+	Scheduler* scheduler = *(Scheduler**)lua_touserdata(lua, lua_upvalueindex(1));
+	if (scheduler == NULL)
+		luaL_error(lua, "the scheduler has been destroyed");
+	return scheduler;
+}
+
+/************* Task channels **************/
+
+// A bounded queue between the tasks of one scheduler. Values are held in the registry;
+// a task that receives from an empty channel or sends to a full one waits in line.
+struct TaskChannel {
+	size_t capacity;
+	std::deque<int> values;
+	std::deque<uint64_t> receivers;
+	std::deque<std::pair<uint64_t, int> > senders; // task and the value it is sending
+};
+
+static TaskChannel* checkTaskChannel(lua_State* lua, int arg)
+{
+	bool same = false;
+	if (lua_type(lua, arg) == LUA_TUSERDATA && lua_getmetatable(lua, arg)) {
+		same = lua_rawequal(lua, -1, lua_upvalueindex(2)) != 0;
+		lua_pop(lua, 1);
+	}
+	luaL_argcheck(lua, same, arg, "expected a channel");
+	return (TaskChannel*)lua_touserdata(lua, arg);
+}
+
+static int async_channel(lua_State* lua)
+{
+	lua_Integer capacity = luaL_optinteger(lua, 1, 1);
+	luaL_argcheck(lua, capacity > 0, 1, "capacity must be positive");
+	TaskChannel* channel = (TaskChannel*)lua_newuserdata(lua, sizeof(TaskChannel));
+	new (channel) TaskChannel();
+	channel->capacity = (size_t)capacity;
+	lua_pushvalue(lua, lua_upvalueindex(2));
+	lua_setmetatable(lua, -2);
+	return 1;
+}
+
+// __gc
+static int channel_free(lua_State* lua)
+{
+	TaskChannel* channel = (TaskChannel*)lua_touserdata(lua, 1);
+	for (int ref : channel->values)
+		luaL_unref(lua, LUA_REGISTRYINDEX, ref);
+	for (auto& sender : channel->senders)
+		luaL_unref(lua, LUA_REGISTRYINDEX, sender.second);
+	channel->~TaskChannel();
+	return 0;
+}
+
+// hands the value to the first receiver still alive, else buffers it, else waits
+static int channel_send(lua_State* lua)
+{
+	TaskChannel* channel = checkTaskChannel(lua, 1);
+	luaL_checkany(lua, 2);
+	lua_settop(lua, 2);
+	Scheduler* scheduler = checkScheduler(lua);
+
+	while (!channel->receivers.empty()) {
+		uint64_t receiver = channel->receivers.front();
+		channel->receivers.pop_front();
+		lua_State* thread = scheduler->thread(receiver);
+		if (thread != NULL) {
+			lua_xmove(lua, thread, 1);
+			scheduler->wake(receiver, 1);
+			return 0;
+		}
+	}
+	if (channel->values.size() < channel->capacity) {
+		channel->values.push_back(luaL_ref(lua, LUA_REGISTRYINDEX));
+		return 0;
+	}
+	uint64_t task = scheduler->suspend(lua);
+	channel->senders.push_back(std::make_pair(task, luaL_ref(lua, LUA_REGISTRYINDEX)));
+	return lua_yield(lua, 0);
+}
+
+// takes the oldest value, letting the first waiting sender into the buffer, else waits
+static int channel_recv(lua_State* lua)
+{
+	TaskChannel* channel = checkTaskChannel(lua, 1);
+	Scheduler* scheduler = checkScheduler(lua);
+
+	if (channel->values.empty()) {
+		uint64_t task = scheduler->suspend(lua);
+		channel->receivers.push_back(task);
+		return lua_yield(lua, 0);
+	}
+	int ref = channel->values.front();
+	channel->values.pop_front();
+	lua_rawgeti(lua, LUA_REGISTRYINDEX, ref);
+	luaL_unref(lua, LUA_REGISTRYINDEX, ref);
+
+	while (!channel->senders.empty()) {
+		std::pair<uint64_t, int> sender = channel->senders.front();
+		channel->senders.pop_front();
+		if (scheduler->thread(sender.first) != NULL) {
+			channel->values.push_back(sender.second);
+			scheduler->wake(sender.first, 0);
+			break;
+		}
+		luaL_unref(lua, LUA_REGISTRYINDEX, sender.second);
+	}
+	return 1;
+}
+
+static int channel_size(lua_State* lua)
+{
+	TaskChannel* channel = checkTaskChannel(lua, 1);
+	lua_pushinteger(lua, (lua_Integer)channel->values.size());
+	return 1;
+}
+
+/************* async library **************/
+
+// async.spawn(f, ...)
+static int async_spawn(lua_State* lua)
+{
+	Scheduler* scheduler = checkScheduler(lua);
+	luaL_checktype(lua, 1, LUA_TFUNCTION);
+	scheduler->spawn(lua, lua_gettop(lua) - 1);
+	return 0;
+}
+
+// async.sleep(seconds); 0 lets the other ready tasks run first
+static int async_sleep(lua_State* lua)
+{
+	Scheduler* scheduler = checkScheduler(lua);
+	double seconds = luaL_checknumber(lua, 1);
+	uint64_t task = scheduler->suspend(lua);
+	if (seconds > 0)
+		scheduler->wakeAfter(task, seconds);
+	else
+		scheduler->cancel(task); // yields like coroutine.yield, which requeues the task
+	return lua_yield(lua, 0);
+}
+
+// async.read(path) returns the contents of the file, or nil and a message
+static int async_read(lua_State* lua)
+{
+	Scheduler* scheduler = checkScheduler(lua);
+	const char* path = luaL_checkstring(lua, 1);
+	uint64_t task = scheduler->suspend(lua, true);
+	scheduler->readFile(task, path);
+	return lua_yield(lua, 0);
+}
+
+#ifdef SCHEDULER_EPOLL
+// async.wait(fd, "r" or "w") returns when the descriptor is ready
+static int async_wait(lua_State* lua)
+{
+	Scheduler* scheduler = checkScheduler(lua);
+	int fd = (int)luaL_checkinteger(lua, 1);
+	const char* modes[] = {"r", "w", NULL};
+	bool write = luaL_checkoption(lua, 2, "r", modes) == 1;
+	uint64_t task = scheduler->suspend(lua);
+	if (!scheduler->wakeOnReady(task, fd, write)) {
+		scheduler->cancel(task);
+		return luaL_error(lua, "cannot wait on descriptor %d: %s", fd, strerror(errno));
+	}
+	return lua_yield(lua, 0);
+}
+#endif
+
+// the box is on the top of the stack
+static void openAsync(lua_State* lua)
+{
+	const luaL_Reg asyncFunctions[] = {
+		{"spawn", async_spawn},
+		{"sleep", async_sleep},
+		{"read", async_read},
+#ifdef SCHEDULER_EPOLL
+		{"wait", async_wait},
+#endif
+		{"channel", async_channel},
+		{NULL, NULL}
+	};
+	const luaL_Reg channelMethods[] = {
+		{"send", channel_send},
+		{"recv", channel_recv},
+		{"size", channel_size},
+		{NULL, NULL}
+	};
+	int box = lua_gettop(lua);
+
+	lua_newtable(lua); // channel metatable
+	int metatable = lua_gettop(lua);
+	lua_pushcfunction(lua, channel_free);
+	lua_setfield(lua, metatable, "__gc");
+		lua_newtable(lua);
+		lua_pushvalue(lua, box);
+		lua_pushvalue(lua, metatable);
+		luaL_setfuncs(lua, channelMethods, 2);
+	lua_setfield(lua, metatable, "__index");
+
+	luaL_newlibtable(lua, asyncFunctions);
+	lua_pushvalue(lua, box);
+	lua_pushvalue(lua, metatable);
+	luaL_setfuncs(lua, asyncFunctions, 2);
+	lua_setglobal(lua, "async");
+	lua_settop(lua, box - 1);
+}
+
+/************* Scheduler **************/
+
+Scheduler::Scheduler(lua_State* lua)
+	: lua(lua), nextTask(1), nextTimer(0), pendingPosts(0), stopping(false),
+	errorHandler(printTaskError), stats(), readerStopping(false)
+{
+	self = std::make_shared<SchedulerHandle>();
+	self->scheduler = this;
+#ifdef SCHEDULER_EPOLL
+	epollFd = epoll_create1(EPOLL_CLOEXEC);
+	eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (epollFd < 0 || eventFd < 0)
+		throw std::runtime_error(std::string("cannot create the scheduler's epoll: ") + strerror(errno));
+	struct epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.fd = eventFd;
+	epoll_ctl(epollFd, EPOLL_CTL_ADD, eventFd, &event);
+#endif
+
+	box = (Scheduler**)lua_newuserdata(lua, sizeof(Scheduler*));
+	*box = this;
+	lua_pushvalue(lua, -1);
+	lua_rawsetp(lua, LUA_REGISTRYINDEX, &SchedulerKey);
+	openAsync(lua);
+
+	reader = std::thread(&Scheduler::readFiles, this);
+}
+
+Scheduler::~Scheduler()
+{
+	// posts through a handle that are under way finish first; later ones do nothing
+	{
+		std::lock_guard<std::mutex> lock(self->mutex);
+		self->scheduler = NULL;
+	}
+	*box = NULL;
+	if (Scheduler::of(lua) == NULL) {
+		lua_pushnil(lua);
+		lua_rawsetp(lua, LUA_REGISTRYINDEX, &SchedulerKey);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(readMutex);
+		readerStopping = true;
+	}
+	readSignal.notify_all();
+	reader.join();
+	for (FileRead* read : reads)
+		delete read;
+
+	// the tasks are dropped first, so every completion left sees a NULL thread
+	for (auto& task : tasks)
+		luaL_unref(lua, LUA_REGISTRYINDEX, task.second.ref);
+	tasks.clear();
+	threads.clear();
+	for (Posted& completion : posted)
+		completion.complete(NULL, completion.data);
+
+#ifdef SCHEDULER_EPOLL
+	close(eventFd);
+	close(epollFd);
+#endif
+}
+
+Scheduler* Scheduler::of(lua_State* lua)
+{
+	Scheduler* scheduler = NULL;
+	if (lua_rawgetp(lua, LUA_REGISTRYINDEX, &SchedulerKey) == LUA_TUSERDATA)
+		scheduler = *(Scheduler**)lua_touserdata(lua, -1);
+	lua_pop(lua, 1);
+	return scheduler;
+}
+
+void Scheduler::spawn(lua_State* from, int nargs)
+{
+	lua_State* thread = lua_newthread(from);
+	int ref = luaL_ref(from, LUA_REGISTRYINDEX);
+	lua_xmove(from, thread, nargs + 1);
+
+	uint64_t id = nextTask++;
+	Task task = {thread, ref, false, false};
+	tasks[id] = task;
+	threads[thread] = id;
+	ready.push_back(std::make_pair(id, nargs));
+	stats.spawned++;
+}
+
+uint64_t Scheduler::suspend(lua_State* thread, bool byPost)
+{
+	auto found = threads.find(thread);
+	if (found == threads.end())
+		luaL_error(thread, "attempt to wait outside a task");
+	if (!lua_isyieldable(thread))
+		luaL_error(thread, "attempt to wait across a C-call boundary");
+	Task& task = tasks[found->second];
+	task.waiting = true;
+	task.byPost = byPost;
+	if (byPost)
+		pendingPosts++;
+	return found->second;
+}
+
+void Scheduler::cancel(uint64_t id)
+{
+	auto found = tasks.find(id);
+	if (found == tasks.end())
+		return;
+	if (found->second.byPost)
+		pendingPosts--;
+	found->second.waiting = false;
+	found->second.byPost = false;
+}
+
+lua_State* Scheduler::thread(uint64_t id) const
+{
+	auto found = tasks.find(id);
+	return found == tasks.end() ? NULL : found->second.thread;
+}
+
+void Scheduler::wake(uint64_t id, int nargs)
+{
+	tasks[id].waiting = false;
+	ready.push_back(std::make_pair(id, nargs));
+}
+
+void Scheduler::wakeAfter(uint64_t id, double seconds)
+{
+	Timer timer = {now() + seconds, nextTimer++, id};
+	timers.push(timer);
+}
+
+#ifdef SCHEDULER_EPOLL
+bool Scheduler::wakeOnReady(uint64_t id, int fd, bool write)
+{
+	struct epoll_event event = {};
+	event.events = (write ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+	event.data.fd = fd;
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) != 0)
+		return false;
+	watched[fd] = id;
+	return true;
+}
+#endif
+
+void Scheduler::post(uint64_t task, Completion complete, void* data)
+{
+	Posted completion = {task, complete, data};
+	{
+		std::lock_guard<std::mutex> lock(postMutex);
+		posted.push_back(completion);
+	}
+#ifdef SCHEDULER_EPOLL
+	uint64_t one = 1;
+	ssize_t written = ::write(eventFd, &one, sizeof(one));
+	(void)written; // EAGAIN only when the counter is already huge: the loop is woken anyway
+#else
+	postedSignal.notify_one();
+#endif
+}
+
+bool SchedulerHandle::post(uint64_t task, Completion complete, void* data)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (scheduler == NULL)
+		return false;
+	scheduler->post(task, complete, data);
+	return true;
+}
+
+void Scheduler::resume(uint64_t id, int nargs)
+{
+	auto found = tasks.find(id);
+	if (found == tasks.end())
+		return;
+	lua_State* thread = found->second.thread;
+	stats.resumes++;
+	int status = lua_resume(thread, lua, nargs);
+	if (status == LUA_YIELD) {
+		// coroutine.yield rather than a wait: the task gets another turn after the others
+		if (!tasks[id].waiting) {
+			lua_settop(thread, 0);
+			ready.push_back(std::make_pair(id, 0));
+		}
+		return;
+	}
+	if (status == LUA_OK) {
+		stats.finished++;
+	}
+	else {
+		stats.failed++;
+		if (errorHandler != NULL)
+			errorHandler(thread);
+	}
+	finish(id);
+}
+
+void Scheduler::finish(uint64_t id)
+{
+	auto found = tasks.find(id);
+	threads.erase(found->second.thread);
+	luaL_unref(lua, LUA_REGISTRYINDEX, found->second.ref);
+	tasks.erase(found);
+}
+
+// runs the completions posted so far and wakes their tasks
+void Scheduler::drainPosted()
+{
+	std::vector<Posted> completions;
+	{
+		std::lock_guard<std::mutex> lock(postMutex);
+		completions.swap(posted);
+	}
+	for (Posted& completion : completions) {
+		auto found = tasks.find(completion.task);
+		if (found == tasks.end()) {
+			completion.complete(NULL, completion.data);
+			continue;
+		}
+		if (found->second.byPost) {
+			found->second.byPost = false;
+			pendingPosts--;
+		}
+		int nargs = completion.complete(found->second.thread, completion.data);
+		wake(completion.task, nargs);
+	}
+}
+
+void Scheduler::expireTimers()
+{
+	double time = now();
+	while (!timers.empty() && timers.top().deadline <= time) {
+		uint64_t id = timers.top().task;
+		timers.pop();
+		if (tasks.count(id))
+			wake(id, 0);
+	}
+}
+
+void Scheduler::wait(double timeout)
+{
+#ifdef SCHEDULER_EPOLL
+	struct epoll_event events[64];
+	int ms = timeout < 0 ? -1 : (int)ceil(timeout * 1000);
+	int count = epoll_wait(epollFd, events, 64, ms);
+	for (int i = 0; i < count; i++) {
+		int fd = events[i].data.fd;
+		if (fd == eventFd) {
+			uint64_t posts;
+			ssize_t n = read(eventFd, &posts, sizeof(posts));
+			(void)n;
+			continue;
+		}
+		auto found = watched.find(fd);
+		if (found == watched.end())
+			continue;
+		uint64_t id = found->second;
+		watched.erase(found);
+		epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, NULL);
+		if (tasks.count(id))
+			wake(id, 0);
+	}
+#else
+	std::unique_lock<std::mutex> lock(postMutex);
+	if (timeout < 0)
+		postedSignal.wait(lock, [this] { return !posted.empty(); });
+	else
+		postedSignal.wait_for(lock, std::chrono::duration<double>(timeout), [this] { return !posted.empty(); });
+	lock.unlock();
+#endif
+	drainPosted();
+}
+
+bool Scheduler::runOnce(double timeout)
+{
+	// only the tasks ready now; tasks they wake run in the next iteration
+	size_t count = ready.size();
+	for (size_t i = 0; i < count; i++) {
+		std::pair<uint64_t, int> next = ready.front();
+		ready.pop_front();
+		resume(next.first, next.second);
+	}
+	if (tasks.empty())
+		return false;
+
+	bool postsDue;
+	{
+		std::lock_guard<std::mutex> lock(postMutex);
+		postsDue = !posted.empty();
+	}
+	bool wakeable = !ready.empty() || !timers.empty() || pendingPosts > 0 || postsDue;
+#ifdef SCHEDULER_EPOLL
+	wakeable = wakeable || !watched.empty();
+#endif
+	// every task left waits on a channel no running task can reach
+	if (!wakeable)
+		return false;
+
+	double wait = ready.empty() ? timeout : 0;
+	if (!timers.empty()) {
+		double due = timers.top().deadline - now();
+		due = due < 0 ? 0 : due;
+		if (wait < 0 || due < wait)
+			wait = due;
+	}
+	this->wait(wait);
+	expireTimers();
+	return true;
+}
+
+void Scheduler::run()
+{
+	stopping = false;
+	while (!stopping && runOnce(-1)) {
+	}
+}
+
+SchedulerMetrics Scheduler::metrics() const
+{
+	SchedulerMetrics m = stats;
+	m.tasks = tasks.size();
+	m.ready = ready.size();
+	return m;
+}
+
+/************* File reads **************/
+
+void Scheduler::readFile(uint64_t task, const char* path)
+{
+	FileRead* read = new FileRead();
+	read->task = task;
+	read->path = path;
+	read->error = 0;
+	{
+		std::lock_guard<std::mutex> lock(readMutex);
+		reads.push_back(read);
+	}
+	readSignal.notify_one();
+}
+
+// the background thread
+void Scheduler::readFiles()
+{
+	for (;;) {
+		FileRead* read;
+		{
+			std::unique_lock<std::mutex> lock(readMutex);
+			readSignal.wait(lock, [this] { return readerStopping || !reads.empty(); });
+			if (readerStopping)
+				return;
+			read = reads.front();
+			reads.pop_front();
+		}
+		FILE* file = fopen(read->path.c_str(), "rb");
+		if (file == NULL) {
+			read->error = errno;
+		}
+		else {
+			char buffer[8192];
+			size_t n;
+			while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+				read->bytes.append(buffer, n);
+			if (ferror(file))
+				read->error = errno ? errno : EIO;
+			fclose(file);
+		}
+		post(read->task, completeRead, read);
+	}
+}
+
+int Scheduler::completeRead(lua_State* thread, void* data)
+{
+	FileRead* read = (FileRead*)data;
+	int results = 0;
+	if (thread != NULL && read->error == 0) {
+		lua_pushlstring(thread, read->bytes.data(), read->bytes.size());
+		results = 1;
+	}
+	else if (thread != NULL) {
+		lua_pushnil(thread);
+		lua_pushfstring(thread, "%s: %s", read->path.c_str(), strerror(read->error));
+		results = 2;
+	}
+	delete read;
+	return results;
+}
@@ -0,0 +1,203 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <lua.hpp>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <queue>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+
+#if defined(__linux__)
+#define SCHEDULER_EPOLL
+#endif
+
+// Runs on the loop thread when a posted operation completes. Pushes the results of the
+// suspended call onto the task's thread and returns how many there are. thread is NULL
+// when the task no longer exists; data must be freed either way.
+typedef int (*Completion)(lua_State* thread, void* data);
+
+// called with the error value on top of the failed task's thread
+typedef void (*TaskErrorHandler)(lua_State* thread);
+
+typedef struct {
+	uint64_t spawned;
+	uint64_t finished;   // tasks whose function returned
+	uint64_t failed;     // tasks that raised an error
+	uint64_t resumes;
+	size_t tasks;        // tasks alive right now
+	size_t ready;        // tasks that will run in the next iteration
+} SchedulerMetrics;
+
+class Scheduler;
+
+// A reference to a Scheduler that other threads may keep after it is destroyed, e.g. in
+// the queue of tasks waiting on a channel. Posting through it does nothing once the
+// scheduler is gone.
+class SchedulerHandle {
+public:
+	// like Scheduler::post; returns false, without calling complete, once the scheduler is
+	// destroyed, and data is then the caller's to free
+	bool post(uint64_t task, Completion complete, void* data);
+
+private:
+	friend class Scheduler;
+	std::mutex mutex;
+	Scheduler* scheduler;
+};
+
+// Runs many Lua functions as coroutines of one state, each a thread from lua_newthread.
+// A task that calls async.sleep, async.read, async.wait or a channel operation yields;
+// the loop resumes it with lua_resume when the timer expires, the read completes, the
+// file descriptor is ready or the channel has room or a value. Plain coroutine.yield
+// gives the other ready tasks a turn. The loop waits in epoll_wait on Linux and on a
+// condition variable elsewhere, where async.wait is not available. Files are read by
+// one background thread.
+//
+// Everything but post runs on the thread that calls run. Destroy the Scheduler before
+// closing its state; async functions called after that raise an error.
+class Scheduler {
+public:
+	// registers the async library in the state
+	explicit Scheduler(lua_State* lua);
+	~Scheduler();
+
+	// Starts the function below the nargs arguments on top of the stack as a new task and
+	// pops them. The task first runs in the next iteration of the loop.
+	void spawn(lua_State* from, int nargs);
+
+	// runs iterations until no task can make progress or stop is called
+	void run();
+
+	// Resumes the ready tasks, then waits up to timeout seconds (forever if negative) for
+	// a timer, completion or file descriptor. Returns false once no task is left, or no
+	// task is waiting on anything that could still wake it.
+	bool runOnce(double timeout);
+
+	// makes run return after the current iteration
+	void stop() { stopping = true; }
+
+	void onError(TaskErrorHandler handler) { errorHandler = handler; }
+
+	SchedulerMetrics metrics() const;
+
+	// the scheduler created last for the state, or NULL
+	static Scheduler* of(lua_State* lua);
+
+	// whether thread runs one of this scheduler's tasks
+	bool isTask(lua_State* thread) const { return threads.count(thread) != 0; }
+
+	/************* Extension points for native async operations **************/
+
+	// Marks the task running on thread as waiting. Raises a Lua error if thread is not a
+	// task of this scheduler or cannot yield. byPost says the task will be woken by post,
+	// which keeps run waiting for it. Finish with return lua_yield(thread, 0).
+	uint64_t suspend(lua_State* thread, bool byPost = false);
+
+	// undoes suspend when the operation could not be started
+	void cancel(uint64_t task);
+
+	// the thread of a task, or NULL once it has finished
+	lua_State* thread(uint64_t task) const;
+
+	// Makes a waiting task ready; nargs values already pushed onto its thread become the
+	// results of the call that suspended it.
+	void wake(uint64_t task, int nargs);
+
+	// wakes a waiting task after the given time
+	void wakeAfter(uint64_t task, double seconds);
+
+#ifdef SCHEDULER_EPOLL
+	// wakes a waiting task when fd is readable or writable; returns false if epoll refuses fd
+	bool wakeOnReady(uint64_t task, int fd, bool write);
+#endif
+
+	// Completes a waiting task from any thread: the loop calls complete, which pushes the
+	// results, and wakes the task.
+	void post(uint64_t task, Completion complete, void* data);
+
+	// for posts from objects that may outlive the scheduler
+	std::shared_ptr<SchedulerHandle> handle() const { return self; }
+
+	// reads a whole file on the background thread and posts the result
+	void readFile(uint64_t task, const char* path);
+
+private:
+	struct Task {
+		lua_State* thread;
+		int ref;             // keeps the thread alive
+		bool waiting;
+		bool byPost;
+	};
+
+	struct Timer {
+		double deadline;
+		uint64_t sequence;   // keeps timers with the same deadline in order
+		uint64_t task;
+		bool operator>(const Timer& other) const
+		{
+			return deadline != other.deadline ? deadline > other.deadline : sequence > other.sequence;
+		}
+	};
+
+	struct Posted {
+		uint64_t task;
+		Completion complete;
+		void* data;
+	};
+
+	struct FileRead {
+		uint64_t task;
+		std::string path;
+		std::string bytes;
+		int error;           // errno, 0 on success
+	};
+
+	lua_State* lua;
+	Scheduler** box;         // the scheduler as the async functions see it
+	std::shared_ptr<SchedulerHandle> self;
+	uint64_t nextTask;
+	uint64_t nextTimer;
+	std::unordered_map<uint64_t, Task> tasks;
+	std::unordered_map<lua_State*, uint64_t> threads;
+	std::deque<std::pair<uint64_t, int> > ready;   // task and how many values to resume it with
+	std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer> > timers;
+	size_t pendingPosts;     // tasks a post will wake; loop thread only
+	bool stopping;
+	TaskErrorHandler errorHandler;
+	SchedulerMetrics stats;
+
+	std::mutex postMutex;
+	std::vector<Posted> posted;
+#ifdef SCHEDULER_EPOLL
+	int epollFd;
+	int eventFd;
+	std::unordered_map<int, uint64_t> watched;     // file descriptor to waiting task
+#else
+	std::condition_variable postedSignal;
+#endif
+
+	std::thread reader;
+	std::mutex readMutex;
+	std::condition_variable readSignal;
+	std::deque<FileRead*> reads;
+	bool readerStopping;
+
+	void resume(uint64_t id, int nargs);
+	void finish(uint64_t id);
+	void wait(double timeout);
+	void drainPosted();
+	void expireTimers();
+	void readFiles();
+	static int completeRead(lua_State* thread, void* data);
+
+	Scheduler(const Scheduler&) = delete;
+	Scheduler& operator=(const Scheduler&) = delete;
+};
+
+#endif
@@ -0,0 +1,83 @@
+#include "snippet_cache.h"
+#include <string.h>
+
+SnippetCache::SnippetCache(lua_State* lua, size_t capacity)
+	: lua(lua), capacity(capacity), hits(0), misses(0), evictions(0)
+{
+}
+
+SnippetCache::~SnippetCache()
+{
+	clear();
+}
+
+int SnippetCache::load(const char* source, size_t length)
+{
+	std::string key(source, length);
+	auto entry = entries.find(key);
+	if (entry != entries.end()) {
+		hits++;
+		order.splice(order.begin(), order, entry->second.position);
+		lua_rawgeti(lua, LUA_REGISTRYINDEX, entry->second.ref);
+		return LUA_OK;
+	}
+
+	misses++;
+	int status = luaL_loadbuffer(lua, source, length, key.c_str());
+	if (status != LUA_OK || capacity == 0)
+		return status;
+
+	evict(capacity - 1);
+	lua_pushvalue(lua, -1);
+	Entry added;
+	added.ref = luaL_ref(lua, LUA_REGISTRYINDEX);
+	auto inserted = entries.emplace(std::move(key), added).first;
+	order.push_front(&inserted->first);
+	inserted->second.position = order.begin();
+	return LUA_OK;
+}
+
+int SnippetCache::load(const char* source)
+{
+	return load(source, strlen(source));
+}
+
+int SnippetCache::doString(const char* source)
+{
+	int status = load(source);
+	if (status != LUA_OK)
+		return status;
+	return lua_pcall(lua, 0, LUA_MULTRET, 0);
+}
+
+// drops least recently used functions until at most size are left
+void SnippetCache::evict(size_t size)
+{
+	while (entries.size() > size) {
+		auto entry = entries.find(*order.back());
+		luaL_unref(lua, LUA_REGISTRYINDEX, entry->second.ref);
+		order.pop_back();
+		entries.erase(entry);
+		evictions++;
+	}
+}
+
+void SnippetCache::setCapacity(size_t capacity)
+{
+	this->capacity = capacity;
+	evict(capacity);
+}
+
+void SnippetCache::clear()
+{
+	for (auto& entry : entries)
+		luaL_unref(lua, LUA_REGISTRYINDEX, entry.second.ref);
+	entries.clear();
+	order.clear();
+}
+
+SnippetCacheStats SnippetCache::statistics() const
+{
+	SnippetCacheStats stats = {hits, misses, evictions, entries.size(), capacity};
+	return stats;
+}
@@ -0,0 +1,64 @@
+#ifndef SNIPPET_CACHE_H
+#define SNIPPET_CACHE_H
+
+#include <lua.hpp>
+#include <stdint.h>
+#include <string>
+#include <list>
+#include <unordered_map>
+
+typedef struct {
+	uint64_t hits;
+	uint64_t misses;    // snippets compiled, failed compilations included
+	uint64_t evictions;
+	size_t size;        // functions held right now
+	size_t capacity;
+} SnippetCacheStats;
+
+// Least-recently-used cache from source strings to the functions luaL_loadstring compiled
+// them to. The functions stay in the registry through luaL_ref, so a snippet seen before
+// costs a hash lookup instead of a parse. A hit pushes the same function object again:
+// its upvalues, _ENV included, are shared by every load of that snippet. One cache serves
+// one lua_State and must be destroyed before the state is closed.
+class SnippetCache {
+public:
+	SnippetCache(lua_State* lua, size_t capacity);
+	~SnippetCache();
+
+	// like luaL_loadbuffer with the source as chunk name; errors are not cached
+	int load(const char* source, size_t length);
+
+	// like luaL_loadstring
+	int load(const char* source);
+
+	// like luaL_dostring
+	int doString(const char* source);
+
+	// evicts the least recently used functions down to the new capacity
+	void setCapacity(size_t capacity);
+
+	void clear();
+
+	SnippetCacheStats statistics() const;
+
+private:
+	struct Entry {
+		int ref;
+		std::list<const std::string*>::iterator position;
+	};
+
+	lua_State* lua;
+	size_t capacity;
+	std::unordered_map<std::string, Entry> entries;
+	std::list<const std::string*> order; // keys of entries, most recently used first
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+
+	void evict(size_t size);
+
+	SnippetCache(const SnippetCache&) = delete;
+	SnippetCache& operator=(const SnippetCache&) = delete;
+};
+
+#endif
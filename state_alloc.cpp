@@ -0,0 +1,203 @@
+#include "state_alloc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+
+static inline size_t sizeClass(size_t size)
+{
+	return (size - 1) / ALLOC_CLASS_STEP;
+}
+
+StateAllocator::StateAllocator(size_t limit)
+	: bump(NULL), end(NULL), stats()
+{
+	memset(classes, 0, sizeof(classes));
+	stats.limit = limit;
+	// room to record the blocks of failed shrinks without allocating when it happens
+	stranded.reserve(16);
+}
+
+StateAllocator::~StateAllocator()
+{
+	for (void* chunk : chunks)
+		free(chunk);
+	for (const Stranded& s : stranded)
+		free(s.block);
+}
+
+// a block of at least size bytes, or NULL
+void* StateAllocator::obtain(size_t size)
+{
+	if (size > ALLOC_MAX_POOLED) {
+		stats.system++;
+		return malloc(size);
+	}
+	size_t c = sizeClass(size);
+	stats.pooled++;
+	if (classes[c] != NULL) {
+		FreeBlock* block = classes[c];
+		classes[c] = block->next;
+		return block;
+	}
+	size_t bytes = (c + 1) * ALLOC_CLASS_STEP;
+	if ((size_t)(end - bump) < bytes) {
+		// the tail of the old chunk is too small for this class; hand it to smaller ones
+		while ((size_t)(end - bump) >= ALLOC_CLASS_STEP) {
+			size_t tail = (size_t)(end - bump) / ALLOC_CLASS_STEP * ALLOC_CLASS_STEP;
+			if (tail > ALLOC_MAX_POOLED) tail = ALLOC_MAX_POOLED;
+			give(bump, tail);
+			bump += tail;
+		}
+		char* chunk = (char*)malloc(ALLOC_CHUNK);
+		if (chunk == NULL)
+			return NULL;
+		chunks.push_back(chunk);
+		stats.arena += ALLOC_CHUNK;
+		bump = chunk;
+		end = chunk + ALLOC_CHUNK;
+	}
+	void* block = bump;
+	bump += bytes;
+	return block;
+}
+
+void StateAllocator::give(void* block, size_t size)
+{
+	if (size > ALLOC_MAX_POOLED) {
+		free(block);
+		return;
+	}
+	FreeBlock* freed = (FreeBlock*)block;
+	size_t c = sizeClass(size);
+	freed->next = classes[c];
+	classes[c] = freed;
+}
+
+// records a malloc'd block kept at a pooled size; false if even the record cannot be made
+bool StateAllocator::strand(void* block, size_t size)
+{
+	Stranded s = {block, size};
+	if (stranded.size() < stranded.capacity()) {
+		stranded.push_back(s);
+		return true;
+	}
+	try {
+		stranded.push_back(s);
+		return true;
+	}
+	catch (const std::bad_alloc&) {
+		return false;
+	}
+}
+
+// the index of a stranded block, or -1; only pooled sizes can be stranded, and usually
+// none is, so the common case costs one comparison
+int StateAllocator::findStranded(void* block, size_t size) const
+{
+	if (stranded.empty() || size > ALLOC_MAX_POOLED)
+		return -1;
+	for (size_t i = 0; i < stranded.size(); i++)
+		if (stranded[i].block == block)
+			return (int)i;
+	return -1;
+}
+
+void* StateAllocator::allocate(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+	StateAllocator* a = (StateAllocator*)ud;
+	if (ptr == NULL)
+		osize = 0; // osize is the type of the new object, not a size
+	int s = ptr != NULL ? a->findStranded(ptr, osize) : -1;
+
+	if (nsize == 0) {
+		if (s >= 0) {
+			free(ptr);
+			a->stranded.erase(a->stranded.begin() + s);
+		}
+		else if (ptr != NULL) {
+			a->give(ptr, osize);
+		}
+		a->stats.live -= osize;
+		return NULL;
+	}
+
+	// only growth can fail; Lua assumes shrinking a block always succeeds
+	if (nsize > osize && a->stats.limit != 0 && a->stats.live - osize + nsize > a->stats.limit) {
+		a->stats.refused++;
+		return NULL;
+	}
+
+	void* block;
+	if (s >= 0) {
+		// stays with malloc: fits in place up to the size malloc gave it
+		block = ptr;
+		if (nsize > a->stranded[s].size) {
+			a->stats.system++;
+			block = realloc(ptr, nsize);
+			if (block == NULL)
+				return NULL;
+			a->stranded[s].block = block;
+			a->stranded[s].size = nsize;
+		}
+		// past the pooled sizes, the size alone sends the block back to malloc
+		if (nsize > ALLOC_MAX_POOLED)
+			a->stranded.erase(a->stranded.begin() + s);
+	}
+	else if (ptr != NULL && osize <= ALLOC_MAX_POOLED && nsize <= ALLOC_MAX_POOLED && sizeClass(osize) == sizeClass(nsize)) {
+		block = ptr;
+	}
+	else if (ptr != NULL && osize > ALLOC_MAX_POOLED && nsize > ALLOC_MAX_POOLED) {
+		a->stats.system++;
+		block = realloc(ptr, nsize);
+		if (block == NULL && nsize > osize)
+			return NULL;
+		if (block == NULL)
+			block = ptr;
+	}
+	else {
+		block = a->obtain(nsize);
+		// a shrink that needs a new chunk keeps the old, larger block instead of failing. A
+		// malloc'd block kept this way is recorded, so it goes back to malloc when freed;
+		// only if the record cannot be made either does it end up in a size class.
+		if (block == NULL && nsize > osize)
+			return NULL;
+		if (block == NULL) {
+			block = ptr;
+			if (osize > ALLOC_MAX_POOLED)
+				a->strand(ptr, osize);
+		}
+		else if (ptr != NULL) {
+			memcpy(block, ptr, osize < nsize ? osize : nsize);
+			a->give(ptr, osize);
+		}
+	}
+
+	a->stats.live = a->stats.live - osize + nsize;
+	if (a->stats.live > a->stats.peak)
+		a->stats.peak = a->stats.live;
+	return block;
+}
+
+static int panic(lua_State* lua)
+{
+	const char* message = lua_tostring(lua, -1);
+	fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n", message ? message : "error object is not a string");
+	return 0; // returning from a panic handler aborts
+}
+
+lua_State* StateAllocator::newState()
+{
+	lua_State* lua = lua_newstate(allocate, this);
+	if (lua != NULL)
+		lua_atpanic(lua, panic);
+	return lua;
+}
+
+StateAllocator* StateAllocator::of(lua_State* lua)
+{
+	void* ud;
+	if (lua_getallocf(lua, &ud) != allocate)
+		return NULL;
+	return (StateAllocator*)ud;
+}
@@ -0,0 +1,76 @@
+#ifndef STATE_ALLOC_H
+#define STATE_ALLOC_H
+
+#include <lua.hpp>
+#include <stdint.h>
+#include <vector>
+
+// blocks up to ALLOC_MAX_POOLED bytes are served from size classes ALLOC_CLASS_STEP apart
+#define ALLOC_CLASS_STEP 16
+#define ALLOC_MAX_POOLED 256
+#define ALLOC_CLASSES (ALLOC_MAX_POOLED / ALLOC_CLASS_STEP)
+#define ALLOC_CHUNK ((size_t)64 * 1024)
+
+typedef struct {
+	size_t live;       // bytes the state holds right now
+	size_t peak;       // highest live ever reached
+	size_t limit;      // live may not grow past this; 0 means no limit
+	size_t arena;      // bytes of the chunks the size classes are carved from
+	uint64_t pooled;   // allocations served from a size class
+	uint64_t system;   // allocations that went to malloc or realloc
+	uint64_t refused;  // allocations refused because of the limit
+} StateAllocatorStats;
+
+// A lua_Alloc for one lua_State. Small blocks - strings, tables, closures, upvalues - come
+// from per-size-class free lists refilled from bump-allocated 64 KB chunks, so churning
+// through them never reaches malloc; larger blocks go to malloc. When an allocation would
+// take live bytes past the limit it fails, and Lua raises a memory error in the state
+// instead of the process running out of memory. Not thread-safe: a state runs on one
+// thread at a time, and so does its allocator.
+class StateAllocator {
+public:
+	explicit StateAllocator(size_t limit = 0);
+
+	// frees the chunks; close the state first
+	~StateAllocator();
+
+	// like luaL_newstate but allocating through this allocator
+	lua_State* newState();
+
+	// the allocator of a state made by newState, or NULL
+	static StateAllocator* of(lua_State* lua);
+
+	void setLimit(size_t bytes) { stats.limit = bytes; }
+
+	StateAllocatorStats statistics() const { return stats; }
+
+	static void* allocate(void* ud, void* ptr, size_t osize, size_t nsize);
+
+private:
+	struct FreeBlock {
+		FreeBlock* next;
+	};
+
+	// a malloc'd block a failed shrink left at a pooled size; it still goes back to malloc
+	struct Stranded {
+		void* block;
+		size_t size; // bytes malloc gave it
+	};
+
+	FreeBlock* classes[ALLOC_CLASSES];
+	char* bump;
+	char* end;
+	std::vector<void*> chunks;
+	std::vector<Stranded> stranded;
+	StateAllocatorStats stats;
+
+	void* obtain(size_t size);
+	void give(void* block, size_t size);
+	bool strand(void* block, size_t size);
+	int findStranded(void* block, size_t size) const;
+
+	StateAllocator(const StateAllocator&) = delete;
+	StateAllocator& operator=(const StateAllocator&) = delete;
+};
+
+#endif
@@ -0,0 +1,176 @@
+#include "state_pool.h"
+#include <assert.h>
+#include <chrono>
+
+/************* Globals snapshot **************/
+
+// registry[&SnapshotKey] maps each restored table (_G, package.loaded) to a shallow copy of it
+static char SnapshotKey;
+
+// pushes a shallow copy of the table at the given absolute index
+static void copyTable(lua_State* lua, int table)
+{
+	lua_newtable(lua);
+	int copy = lua_gettop(lua);
+	lua_pushnil(lua);
+	while (lua_next(lua, table)) {
+		lua_pushvalue(lua, -2);
+		lua_insert(lua, -2);
+		lua_rawset(lua, copy);
+	}
+}
+
+static void snapshotGlobals(lua_State* lua)
+{
+	lua_newtable(lua);
+	int snapshot = lua_gettop(lua);
+
+	lua_pushglobaltable(lua);
+	copyTable(lua, snapshot + 1);
+	lua_rawset(lua, snapshot);
+
+	luaL_getsubtable(lua, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+	copyTable(lua, snapshot + 1);
+	lua_rawset(lua, snapshot);
+
+	lua_rawsetp(lua, LUA_REGISTRYINDEX, &SnapshotKey);
+}
+
+// removes the fields the copy does not have, then writes back every field of the copy
+static void restoreTable(lua_State* lua, int table, int copy)
+{
+	lua_pushnil(lua);
+	while (lua_next(lua, table)) {
+		lua_pop(lua, 1);
+		lua_pushvalue(lua, -1);
+		if (lua_rawget(lua, copy) == LUA_TNIL) {
+			// clearing a field during lua_next is allowed
+			lua_pushvalue(lua, -2);
+			lua_pushnil(lua);
+			lua_rawset(lua, table);
+		}
+		lua_pop(lua, 1);
+	}
+
+	lua_pushnil(lua);
+	while (lua_next(lua, copy)) {
+		lua_pushvalue(lua, -2);
+		lua_insert(lua, -2);
+		lua_rawset(lua, table);
+	}
+}
+
+static void restoreGlobals(lua_State* lua)
+{
+	lua_settop(lua, 0);
+	lua_rawgetp(lua, LUA_REGISTRYINDEX, &SnapshotKey);
+	lua_pushnil(lua);
+	while (lua_next(lua, 1)) {
+		restoreTable(lua, 2, 3);
+		lua_pop(lua, 1);
+	}
+	lua_settop(lua, 0);
+}
+
+/************* State pool **************/
+
+StatePool::StatePool(size_t size, StateSetup setup, size_t memoryLimit)
+	: stats()
+{
+	states.reserve(size);
+	available.reserve(size);
+	for (size_t i = 0; i < size; i++) {
+		StateAllocator* allocator = new StateAllocator();
+		lua_State* lua = allocator->newState();
+		luaL_openlibs(lua);
+		if (setup)
+			setup(lua);
+		lua_settop(lua, 0);
+		snapshotGlobals(lua);
+		allocator->setLimit(memoryLimit);
+		states.push_back({this, lua, allocator, 0});
+	}
+	// states no longer grows, so pointers into it stay valid
+	for (PooledState& state : states) {
+		*(PooledState**)lua_getextraspace(state.lua) = &state;
+		available.push_back(&state);
+	}
+	stats.available = size;
+}
+
+StatePool::~StatePool()
+{
+	for (PooledState& state : states) {
+		lua_close(state.lua);
+		delete state.allocator;
+	}
+}
+
+// pops a free state; the mutex must be held and available must not be empty
+lua_State* StatePool::take()
+{
+	PooledState* state = available.back();
+	available.pop_back();
+	if (state->leases++ > 0)
+		stats.reuses++;
+	stats.leases++;
+	stats.available = available.size();
+	return state->lua;
+}
+
+lua_State* StatePool::lease()
+{
+	auto start = std::chrono::steady_clock::now();
+	std::unique_lock<std::mutex> lock(mutex);
+	if (available.empty()) {
+		stats.waits++;
+		returned.wait(lock, [this] { return !available.empty(); });
+		double waited = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		stats.waitSeconds += waited;
+		if (waited > stats.maxWaitSeconds)
+			stats.maxWaitSeconds = waited;
+	}
+	return take();
+}
+
+lua_State* StatePool::tryLease()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return available.empty() ? NULL : take();
+}
+
+void StatePool::reset(lua_State* lua)
+{
+	// set by the constructor; lua must have been leased from this pool
+	PooledState* state = *(PooledState**)lua_getextraspace(lua);
+	assert(state->pool == this && state->lua == lua);
+
+	// the reset runs unprotected, so it must not hit the memory limit
+	size_t limit = state->allocator->statistics().limit;
+	state->allocator->setLimit(0);
+	restoreGlobals(lua);
+	lua_gc(lua, LUA_GCSTEP, 0);
+	state->allocator->setLimit(limit);
+}
+
+void StatePool::release(lua_State* lua)
+{
+	if (lua == NULL)
+		return;
+	// the state is still private to the caller, so reset it before taking the lock
+	reset(lua);
+	PooledState* state = *(PooledState**)lua_getextraspace(lua);
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		available.push_back(state);
+		stats.available = available.size();
+	}
+	returned.notify_one();
+}
+
+StatePoolMetrics StatePool::metrics() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return stats;
+}
@@ -0,0 +1,85 @@
+#ifndef STATE_POOL_H
+#define STATE_POOL_H
+
+#include <lua.hpp>
+#include "state_alloc.h"
+#include <stdint.h>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+// registers the bindings a pooled state needs, e.g. openArray
+typedef void (*StateSetup)(lua_State* lua);
+
+typedef struct {
+	uint64_t leases;       // states handed out
+	uint64_t reuses;       // leases of a state that had been leased before
+	uint64_t waits;        // leases that found the pool empty
+	double waitSeconds;    // total time lease spent blocked
+	double maxWaitSeconds;
+	size_t available;      // states in the pool right now
+} StatePoolMetrics;
+
+// A fixed set of lua_States created up front with the standard libraries opened and the
+// setup bindings registered. lease and release are O(1) and safe to call from any thread.
+// Released states get back the globals and package.loaded they had right after setup;
+// changes made inside library tables (e.g. string.foo = ...) are not undone.
+// Every state allocates through its own StateAllocator; a memoryLimit other than 0 caps
+// the bytes each state may hold once setup is done.
+class StatePool {
+public:
+	StatePool(size_t size, StateSetup setup, size_t memoryLimit = 0);
+	~StatePool();
+
+	// takes a state out of the pool, waiting for one if all are leased
+	lua_State* lease();
+
+	// like lease but returns NULL instead of waiting
+	lua_State* tryLease();
+
+	// resets a leased state and puts it back in the pool
+	void release(lua_State* lua);
+
+	// gives a leased state back the globals it had after setup, keeping the lease; the cost
+	// grows with the number of globals and loaded modules
+	void reset(lua_State* lua);
+
+	StatePoolMetrics metrics() const;
+
+	size_t size() const { return states.size(); }
+
+	// releases the state when it goes out of scope
+	class Lease {
+	public:
+		explicit Lease(StatePool& pool) : pool(pool), lua(pool.lease()) {}
+		~Lease() { pool.release(lua); }
+		Lease(const Lease&) = delete;
+		Lease& operator=(const Lease&) = delete;
+		lua_State* state() const { return lua; }
+		operator lua_State*() const { return lua; }
+	private:
+		StatePool& pool;
+		lua_State* lua;
+	};
+
+private:
+	struct PooledState {
+		StatePool* pool;
+		lua_State* lua;
+		StateAllocator* allocator;
+		uint64_t leases;
+	};
+
+	std::vector<PooledState> states;
+	std::vector<PooledState*> available; // stack of free states; never grows past states.size()
+	mutable std::mutex mutex;
+	std::condition_variable returned;
+	StatePoolMetrics stats;
+
+	lua_State* take();
+
+	StatePool(const StatePool&) = delete;
+	StatePool& operator=(const StatePool&) = delete;
+};
+
+#endif